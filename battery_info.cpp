@@ -1,14 +1,19 @@
 #include "battery_info.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
 #include <cerrno>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <regex>
-#include <set>
 #include <sstream>
 #include <string>
 #include <sys/select.h>
@@ -18,6 +23,10 @@
 #include <utility>
 #include <vector>
 
+#include "power_supply.h"
+#include "trace.h"
+#include "upower_parser.h"
+
 namespace {
 
 void UnrecoverableErrorImplementation(std::ostream& stream) {}
@@ -42,9 +51,12 @@ void PrintUnrecoverableErrorAndAbort(Args&& ...args) {
 bool GetFastUpdateIntervalAndSetToFalse();
 bool GetError(std::string& error);
 void SetError(const std::string& new_error);
+void InvalidateBatteryDetails();
 void SetFastUpdateIntervalToTrue();
 void Update();
-void UpdateLoop();
+void UpdateLoop(int descriptor);
+void UpowerUpdateLoop(int descriptor);
+void DispatchLoop();
 
 struct SingleBatteryInfoInternal {
   std::string id;
@@ -54,6 +66,8 @@ struct SingleBatteryInfoInternal {
   int energy_full;
   int power_now;
   BatteryStatus status;
+  // Only filled from tlp-stat.
+  BatteryDetails details;
 };
 
 struct BatteryInfoInternal {
@@ -62,77 +76,323 @@ struct BatteryInfoInternal {
   int minutes_left;
   std::vector<SingleBatteryInfo> sbis;
   BatteryInfo bi;
+  // Of the event that caused the snapshot, for tracing.
+  unsigned long long correlation_id = 0;
+};
+
+void ComputeCharge(SingleBatteryInfoInternal& sbii) {
+  if (sbii.energy_full == 0) {
+    sbii.charge = 0;
+  } else {
+    sbii.charge = sbii.energy_now * 100.0 / sbii.energy_full;
+  }
+}
+
+// The output of `tlp-stat -b` is parsed in place, line by line, because
+// std::regex allocates on every search. A battery looks like this:
+//
+// +++ ThinkPad Battery Status: BAT0 (Main / Internal)
+// /sys/class/power_supply/BAT0/manufacturer                   = SMP
+// /sys/class/power_supply/BAT0/model_name                     = 45N1773
+// /sys/class/power_supply/BAT0/cycle_count                    = 327
+// /sys/class/power_supply/BAT0/energy_full_design             =  23200 [mWh]
+// /sys/class/power_supply/BAT0/energy_full                    =  24610 [mWh]
+// /sys/class/power_supply/BAT0/energy_now                     =  14790 [mWh]
+// /sys/class/power_supply/BAT0/power_now                      =   4416 [mW]
+// /sys/class/power_supply/BAT0/status                         = Discharging
+//
+// tpacpi-bat.BAT0.startThreshold                              =    96 [%]
+// tpacpi-bat.BAT0.stopThreshold                               =   100 [%]
+// tpacpi-bat.BAT0.forceDischarge                              =     0
+//
+// The id is BAT0 and the name is the last word in the parentheses. A battery
+// is used only if energy_full, energy_now, power_now and status are all there.
+
+constexpr char TlpBatteryHeader[] = "+++ ThinkPad Battery Status:";
+constexpr char TlpPowerSupplyPrefix[] = "/sys/class/power_supply/";
+constexpr char TlpThresholdPrefix[] = "tpacpi-bat.";
+
+enum TlpField {
+  kTlpEnergyFull = 1 << 0,
+  kTlpEnergyNow = 1 << 1,
+  kTlpPowerNow = 1 << 2,
+  kTlpStatus = 1 << 3,
+  kAllTlpFields = (1 << 4) - 1,
 };
 
-std::regex tlp_output_regex(
-    // Battery header.
-    // \1 - battery id (eg. BAT0)
-    // \2 - battery name (eg. Internal)
-    R"(\+\+\+ ThinkPad Battery Status:[[:space:]]+([[:alnum:]]+)[[:space:]]+)"
-        R"(\(.*[[:space:]]+([[:alnum:]]+)\)\n)"
-    // Manufacturer - ignored.
-    R"(/sys/class/power_supply/\1/manufacturer[[:space:]]*=.*\n)"
-    // Model name - ignored.
-    R"(/sys/class/power_supply/\1/model_name[[:space:]]*=.*\n)"
-    // Cycle count - ignored.
-    R"(/sys/class/power_supply/\1/cycle_count[[:space:]]*=.*\n)"
-    // Energy full design - ignored.
-    R"(/sys/class/power_supply/\1/energy_full_design[[:space:]]*=.*\n)"
-    // Energy full.
-    // \3 - energy full (eg. 24610) [mWh]
-    R"(/sys/class/power_supply/\1/energy_full[[:space:]]*=)"
-        R"([[:space:]]*([[:digit:]]{1,8})[[:space:]]\[mWh\]\n)"
-    // Energy now.
-    // \4 - energy now (eg. 14790) [mWh]
-    R"(/sys/class/power_supply/\1/energy_now[[:space:]]*=)"
-        R"([[:space:]]*([[:digit:]]{1,8})[[:space:]]\[mWh\]\n)"
-    // Power now.
-    // \5 - power now (eg. 4416) [mW]
-    R"(/sys/class/power_supply/\1/power_now[[:space:]]*=)"
-        R"([[:space:]]*([[:digit:]]{1,8})[[:space:]]\[mW\]\n)"
-    // Status.
-    // \6 - status (eg. Full/Charging/Discharging)
-    R"(/sys/class/power_supply/\1/status[[:space:]]*=)"
-        R"([[:space:]]*([[:alnum:]].*)\n)"
-    // Empty line.
-    R"(\n)"
-    // Start threshold - ignored.
-    R"(tpacpi-bat.\1.startThreshold[[:space:]]*=.*\n)"
-    // Stop threshold - ignored.
-    R"(tpacpi-bat.\1.stopThreshold[[:space:]]*=.*\n)"
-    // Force discharge - ignored.
-    R"(tpacpi-bat.\1.forceDischarge[[:space:]]*=.*\n)",
-    std::regex::optimize);
-
-SingleBatteryInfoInternal AnalizeBatteryFromRegexMatch(
-    const std::smatch& match) {
-  SingleBatteryInfoInternal sbii;
-  sbii.id = match[1].str();
-  sbii.name = match[2].str();
-  sbii.energy_full = std::atoi(match[3].str().c_str());
-  sbii.energy_now = std::atoi(match[4].str().c_str());
-  sbii.power_now = std::atoi(match[5].str().c_str());
-  const std::string& status = match[6].str();
-  if (status == "Full") {
+bool IsAlnum(char c) {
+  return std::isalnum(static_cast<unsigned char>(c));
+}
+
+bool IsSpace(char c) {
+  return std::isspace(static_cast<unsigned char>(c));
+}
+
+bool StartsWith(const char* begin, const char* end, const char* prefix) {
+  const size_t length = strlen(prefix);
+  return static_cast<size_t>(end - begin) >= length and
+         memcmp(begin, prefix, length) == 0;
+}
+
+bool Equals(const char* begin, const char* end, const char* text) {
+  return static_cast<size_t>(end - begin) == strlen(text) and
+         memcmp(begin, text, end - begin) == 0;
+}
+
+bool ParseTlpBatteryHeader(const char* begin, const char* end,
+                           SingleBatteryInfoInternal& sbii) {
+  begin += strlen(TlpBatteryHeader);
+  while (begin < end and IsSpace(*begin)) {
+    begin++;
+  }
+  const char* id_end = begin;
+  while (id_end < end and IsAlnum(*id_end)) {
+    id_end++;
+  }
+  const char* name_end = end;
+  while (name_end > id_end and name_end[-1] != ')') {
+    name_end--;
+  }
+  if (id_end == begin or name_end == id_end) {
+    return false;
+  }
+  name_end--;
+  const char* name_begin = name_end;
+  while (name_begin > id_end and IsAlnum(name_begin[-1])) {
+    name_begin--;
+  }
+  if (name_begin == name_end) {
+    return false;
+  }
+  sbii.id.assign(begin, id_end);
+  sbii.name.assign(name_begin, name_end);
+  return true;
+}
+
+// Parses "<digits> [<unit>]".
+bool ParseTlpNumber(const char* begin, const char* end, int& value) {
+  if (begin == end or !std::isdigit(static_cast<unsigned char>(*begin))) {
+    return false;
+  }
+  value = 0;
+  while (begin < end and std::isdigit(static_cast<unsigned char>(*begin))) {
+    value = value * 10 + (*begin - '0');
+    begin++;
+  }
+  return true;
+}
+
+void ParseTlpNumberOrUnknown(const char* begin, const char* end, int& value) {
+  if (!ParseTlpNumber(begin, end, value)) {
+    value = -1;
+  }
+}
+
+void CopyTlpString(const char* begin, const char* end, char* dst, size_t size) {
+  const size_t length = std::min(static_cast<size_t>(end - begin), size - 1);
+  memcpy(dst, begin, length);
+  dst[length] = '\0';
+}
+
+// Parses a status from sysfs (eg. Discharging).
+BatteryStatus ParseStatus(const char* begin, const char* end) {
+  if (Equals(begin, end, "Full")) {
+    return kFull;
+  } else if (Equals(begin, end, "Charging")) {
+    return kCharging;
+  } else if (Equals(begin, end, "Discharging")) {
+    return kDischarging;
+  } else {
+    return kUnused;
+  }
+}
+
+// Splits "<attribute> = <value>", where @begin points at the attribute.
+bool SplitTlpAttribute(const char* begin, const char* end,
+                       const char*& attribute_end,
+                       const char*& value_begin, const char*& value_end) {
+  const char* equals =
+      static_cast<const char*>(memchr(begin, '=', end - begin));
+  if (equals == NULL) {
+    return false;
+  }
+  attribute_end = equals;
+  while (attribute_end > begin and IsSpace(attribute_end[-1])) {
+    attribute_end--;
+  }
+  value_begin = equals + 1;
+  value_end = end;
+  while (value_begin < value_end and IsSpace(*value_begin)) {
+    value_begin++;
+  }
+  while (value_end > value_begin and IsSpace(value_end[-1])) {
+    value_end--;
+  }
+  return true;
+}
+
+// Skips "<prefix><id><separator>". Returns NULL if the line is about another
+// battery.
+const char* SkipTlpBatteryPrefix(const char* begin, const char* end,
+                                 const char* prefix, const std::string& id,
+                                 char separator) {
+  begin += strlen(prefix);
+  if (!StartsWith(begin, end, id.c_str())) {
+    return NULL;
+  }
+  begin += id.size();
+  if (begin == end or *begin != separator) {
+    return NULL;
+  }
+  return begin + 1;
+}
+
+// Returns the TlpField set by the line, or 0.
+int ParseTlpAttributeLine(const char* begin, const char* end,
+                          SingleBatteryInfoInternal& sbii) {
+  begin = SkipTlpBatteryPrefix(begin, end, TlpPowerSupplyPrefix, sbii.id, '/');
+  const char* attribute_end;
+  const char* value_begin;
+  const char* value_end;
+  if (begin == NULL or
+      !SplitTlpAttribute(begin, end, attribute_end, value_begin, value_end)) {
+    return 0;
+  }
+  BatteryDetails& details = sbii.details;
+  if (Equals(begin, attribute_end, "energy_full")) {
+    return ParseTlpNumber(value_begin, value_end, sbii.energy_full)
+               ? kTlpEnergyFull : 0;
+  } else if (Equals(begin, attribute_end, "energy_now")) {
+    return ParseTlpNumber(value_begin, value_end, sbii.energy_now)
+               ? kTlpEnergyNow : 0;
+  } else if (Equals(begin, attribute_end, "power_now")) {
+    return ParseTlpNumber(value_begin, value_end, sbii.power_now)
+               ? kTlpPowerNow : 0;
+  } else if (Equals(begin, attribute_end, "status")) {
+    sbii.status = ParseStatus(value_begin, value_end);
+    return kTlpStatus;
+  } else if (Equals(begin, attribute_end, "manufacturer")) {
+    CopyTlpString(value_begin, value_end, details.manufacturer,
+                  sizeof(details.manufacturer));
+  } else if (Equals(begin, attribute_end, "model_name")) {
+    CopyTlpString(value_begin, value_end, details.model_name,
+                  sizeof(details.model_name));
+  } else if (Equals(begin, attribute_end, "cycle_count")) {
+    // Eg. "(not supported)".
+    ParseTlpNumberOrUnknown(value_begin, value_end, details.cycle_count);
+  } else if (Equals(begin, attribute_end, "energy_full_design")) {
+    ParseTlpNumberOrUnknown(value_begin, value_end,
+                            details.energy_full_design);
+  }
+  return 0;
+}
+
+void ParseTlpThresholdLine(const char* begin, const char* end,
+                           SingleBatteryInfoInternal& sbii) {
+  begin = SkipTlpBatteryPrefix(begin, end, TlpThresholdPrefix, sbii.id, '.');
+  const char* attribute_end;
+  const char* value_begin;
+  const char* value_end;
+  if (begin == NULL or
+      !SplitTlpAttribute(begin, end, attribute_end, value_begin, value_end)) {
+    return;
+  }
+  BatteryDetails& details = sbii.details;
+  if (Equals(begin, attribute_end, "startThreshold")) {
+    ParseTlpNumberOrUnknown(value_begin, value_end, details.start_threshold);
+  } else if (Equals(begin, attribute_end, "stopThreshold")) {
+    ParseTlpNumberOrUnknown(value_begin, value_end, details.stop_threshold);
+  } else if (Equals(begin, attribute_end, "forceDischarge")) {
+    ParseTlpNumberOrUnknown(value_begin, value_end, details.force_discharge);
+  }
+}
+
+void ResetBatteryDetails(BatteryDetails& details) {
+  details.manufacturer[0] = '\0';
+  details.model_name[0] = '\0';
+  details.cycle_count = -1;
+  details.energy_full = -1;
+  details.energy_full_design = -1;
+  details.start_threshold = -1;
+  details.stop_threshold = -1;
+  details.force_discharge = -1;
+  details.age_seconds = 0;
+}
+
+// Overwrites @sbiis, reusing its elements.
+void ParseTlpStatOutput(const std::string& tlp_output,
+                        std::vector<SingleBatteryInfoInternal>& sbiis) {
+  size_t number_of_batteries = 0;
+  bool is_in_battery = false;
+  int seen_fields = 0;
+  auto FinishBattery = [&]() {
+    if (is_in_battery and seen_fields == kAllTlpFields) {
+      SingleBatteryInfoInternal& sbii = sbiis[number_of_batteries];
+      ComputeCharge(sbii);
+      sbii.details.energy_full = sbii.energy_full;
+      number_of_batteries++;
+    }
+    is_in_battery = false;
+  };
+  const char* begin = tlp_output.data();
+  const char* const output_end = begin + tlp_output.size();
+  while (begin < output_end) {
+    const char* end = static_cast<const char*>(
+        memchr(begin, '\n', output_end - begin));
+    if (end == NULL) {
+      end = output_end;
+    }
+    if (StartsWith(begin, end, TlpBatteryHeader)) {
+      FinishBattery();
+      if (sbiis.size() == number_of_batteries) {
+        sbiis.emplace_back();
+      }
+      is_in_battery =
+          ParseTlpBatteryHeader(begin, end, sbiis[number_of_batteries]);
+      ResetBatteryDetails(sbiis[number_of_batteries].details);
+      seen_fields = 0;
+    } else if (StartsWith(begin, end, "+++")) {
+      FinishBattery();
+    } else if (is_in_battery and
+               StartsWith(begin, end, TlpPowerSupplyPrefix)) {
+      seen_fields |=
+          ParseTlpAttributeLine(begin, end, sbiis[number_of_batteries]);
+    } else if (is_in_battery and StartsWith(begin, end, TlpThresholdPrefix)) {
+      ParseTlpThresholdLine(begin, end, sbiis[number_of_batteries]);
+    }
+    begin = end + 1;
+  }
+  FinishBattery();
+  sbiis.resize(number_of_batteries);
+}
+
+void AnalizeBatteryFromUpowerRecord(const UpowerBatteryRecord& record,
+                                    SingleBatteryInfoInternal& sbii) {
+  sbii.id = record.native_path;
+  sbii.name = record.model;
+  // Upower reports Wh and W.
+  sbii.energy_full =
+      static_cast<int>(std::lround(record.energy_full_wh * 1000));
+  sbii.energy_now = static_cast<int>(std::lround(record.energy_wh * 1000));
+  sbii.power_now = static_cast<int>(std::lround(record.energy_rate_w * 1000));
+  if (record.state == "fully-charged") {
     sbii.status = kFull;
-  } else if (status == "Charging") {
+  } else if (record.state == "charging") {
     sbii.status = kCharging;
-  } else if (status == "Discharging") {
+  } else if (record.state == "discharging") {
     sbii.status = kDischarging;
   } else {
     sbii.status = kUnused;
   }
-  if (sbii.energy_full == 0) {
-    sbii.charge = 0;
-  } else {
-    sbii.charge = sbii.energy_now * 100.0 / sbii.energy_full;
-  }
-  return sbii;
+  ComputeCharge(sbii);
 }
 
 SingleBatteryInfo MakeExternalSingleBatteryInfo(
     const SingleBatteryInfoInternal& sbii) {
   SingleBatteryInfo sbi;
+  const size_t length = std::min(sbii.id.size(), sizeof(sbi.id) - 1);
+  memcpy(sbi.id, sbii.id.data(), length);
+  sbi.id[length] = '\0';
   sbi.charge = sbii.charge;
   sbi.status = sbii.status;
   return sbi;
@@ -150,6 +410,7 @@ void MakeExternalBatteryInfo(BatteryInfoInternal& bii) {
                const SingleBatteryInfoInternal& sbii_b) -> bool {
               return sbii_a.id < sbii_b.id;
             });
+  bii.sbis.clear();
   for (const SingleBatteryInfoInternal& sbii : bii.sbiis) {
     bii.sbis.push_back(MakeExternalSingleBatteryInfo(sbii));
   }
@@ -204,30 +465,125 @@ void MakeExternalBatteryInfo(BatteryInfoInternal& bii) {
   }
 }
 
-BatteryInfoInternal MakeBatteryInfoInternal(const std::string& tlp_output) {
-  BatteryInfoInternal bii;
-  if (!GetError(bii.error)) {
-    std::sregex_iterator it_begin = std::sregex_iterator(
-        tlp_output.begin(), tlp_output.end(), tlp_output_regex);
-    std::sregex_iterator it_end = std::sregex_iterator();
-    for (auto it = it_begin; it != it_end; ++it) {
-      const std::smatch match = *it;
-      bii.sbiis.push_back(AnalizeBatteryFromRegexMatch(match));
+// The batteries in sysfs, with their attributes kept open. Finding them
+// allocates, so they are found again only when @is_rescan_needed is set (eg.
+// when upower reports a device coming or going).
+struct SysfsReader {
+  std::vector<PowerSupplyBattery> batteries;
+  bool is_rescan_needed = true;
+  std::chrono::steady_clock::time_point scanned_at;
+};
+
+// Reads the fields needed for every update, which sysfs serves cheaply.
+bool ReadSysfsBattery(const PowerSupplyBattery& battery,
+                      SingleBatteryInfoInternal& sbii) {
+  long long energy_now, energy_full, power_now;
+  constexpr int BufferSize = 32;
+  char status[BufferSize];
+  if (!ReadSysfsInteger(battery.energy_now_fd, energy_now) or
+      !ReadSysfsInteger(battery.energy_full_fd, energy_full) or
+      !ReadSysfsInteger(battery.power_now_fd, power_now) or
+      !ReadSysfsString(battery.status_fd, status, BufferSize)) {
+    // Eg. an empty bay, or a battery that has just been removed.
+    return false;
+  }
+  sbii.id = battery.id;
+  // Sysfs reports uWh and uW.
+  sbii.energy_now = static_cast<int>(energy_now / 1000);
+  sbii.energy_full = static_cast<int>(energy_full / 1000);
+  sbii.power_now = static_cast<int>(power_now / 1000);
+  sbii.status = ParseStatus(status, status + strlen(status));
+  ComputeCharge(sbii);
+  return true;
+}
+
+// Overwrites @sbiis, reusing its elements. Returns false and sets @error if
+// sysfs can't be read.
+bool ReadSysfsBatteries(SysfsReader& reader,
+                        std::vector<SingleBatteryInfoInternal>& sbiis,
+                        std::string& error) {
+  if (reader.is_rescan_needed) {
+    if (!FindPowerSupplyBatteries(reader.batteries, error)) {
+      sbiis.clear();
+      return false;
+    }
+    reader.is_rescan_needed = false;
+    reader.scanned_at = std::chrono::steady_clock::now();
+  }
+  sbiis.resize(reader.batteries.size());
+  size_t number_of_batteries = 0;
+  for (const PowerSupplyBattery& battery : reader.batteries) {
+    if (ReadSysfsBattery(battery, sbiis[number_of_batteries])) {
+      number_of_batteries++;
+    }
+  }
+  sbiis.resize(number_of_batteries);
+  return true;
+}
+
+// Only used by the update thread.
+SysfsReader sysfs_reader;
+
+// Fills @bii in place, because @bii.bi points into the other members.
+void MakeBatteryInfoInternal(BatteryInfoInternal& bii) {
+  TraceScope trace("read sysfs");
+  if (GetError(bii.error)) {
+    bii.sbiis.clear();
+  } else {
+    std::string scan_error;
+    if (!ReadSysfsBatteries(sysfs_reader, bii.sbiis, scan_error)) {
+      SetError(scan_error);
     }
   }
   MakeExternalBatteryInfo(bii);
-  return bii;
 }
 
 constexpr int ErrorWaitSeconds = 30;
 constexpr int UpdateIntervalSeconds = 20;
 constexpr int FastUpdateIntervalSeconds = 2;
+constexpr int DispatchThreads = 2;
+
+// A registered callback. Every subscriber has a single slot for the snapshot
+// it has not seen yet, so a newer snapshot replaces an older one instead of
+// queueing behind it, and a subscriber is never run by two dispatch threads
+// at the same time.
+struct Subscriber {
+  BatteryInfoCallback callback;
+  void* data;
+  std::shared_ptr<const BatteryInfoInternal> pending;
+  std::chrono::steady_clock::time_point pending_since;
+  // For the trace; -1 while tracing is disabled.
+  long long pending_since_ns = -1;
+  bool is_running = false;
+  bool is_unregistered = false;
+  std::thread::id running_thread;
+  long long delivered = 0;
+  long long dropped = 0;
+  long long last_lag_us = 0;
+  long long max_lag_us = 0;
+};
 
 std::mutex mutex;
 std::condition_variable cv;
+// Never destroyed: the dispatch threads wait on it until the process exits,
+// and destroying a condition variable with waiters blocks forever.
+std::condition_variable& dispatch_cv = *new std::condition_variable;
+std::condition_variable subscriber_idle_cv;
 std::string error;
 bool fast_update_interval = false;
-std::set<std::pair<BatteryInfoCallback, void*>> callbacks;
+BatteryInfoBackend backend = kSysfsBackend;
+int upower_monitor_descriptor = -1;
+// Set once the upower backend has read a whole recording.
+bool is_recording_finished = false;
+// Never destroyed, like dispatch_cv: a waiter may outlive main().
+std::condition_variable& recording_end_cv = *new std::condition_variable;
+// The last published snapshot, for subscribers that register later.
+std::shared_ptr<const BatteryInfoInternal> latest_bii;
+std::map<std::pair<BatteryInfoCallback, void*>, std::shared_ptr<Subscriber>>
+    callbacks;
+// Subscribers with a pending snapshot that are not running right now, oldest
+// first. A vector, as a deque allocates while it moves along.
+std::vector<std::shared_ptr<Subscriber>> ready_subscribers;
 
 bool GetFastUpdateIntervalAndSetToFalse() {
   std::lock_guard<std::mutex> lock(mutex);
@@ -257,7 +613,14 @@ void TryInit() {
   static bool is_initialized = false;
   if (!is_initialized) {
     is_initialized = true;
-    std::thread(UpdateLoop).detach();
+    if (backend == kUpowerBackend) {
+      std::thread(UpowerUpdateLoop, upower_monitor_descriptor).detach();
+    } else {
+      std::thread(UpdateLoop, upower_monitor_descriptor).detach();
+    }
+    for (int i = 0; i < DispatchThreads; i++) {
+      std::thread(DispatchLoop).detach();
+    }
   }
 }
 
@@ -268,50 +631,74 @@ void WaitForNonEmptyCallbacks() {
   }
 }
 
-void UpdateLoop() {
-  bool is_pipe_created = false;
-  int upower_to_me_descriptor;
+// Runs `upower @option` in the background, with its stdout connected to
+// @descriptor.
+bool StartUpower(char* option, int& descriptor) {
+  int p[2];
+  if (pipe(p) != 0) {
+    SetError("Couldn't create a pipe: " + std::string(strerror(errno)));
+    return false;
+  }
+  int pid = fork();
+  if (pid == -1) {
+    SetError("Couldn't fork: " + std::string(strerror(errno)));
+    if (close(p[0]) == -1 or close(p[1]) == -1) {
+      UnrecoverableError("Close failed: ", strerror(errno));
+    }
+    return false;
+  }
+  if (pid == 0) {
+    // Child.
+    if (dup2(p[1], 1 /* stdout */) == -1) {
+      UnrecoverableError("Dup2 failed: ", strerror(errno));
+    }
+    if (close(p[0]) == -1) {
+      UnrecoverableError("Close failed: ", strerror(errno));
+    }
+    char* const envp[] = {NULL};
+    char* const argv[] = {"/usr/bin/upower", option, NULL};
+    execve(argv[0], argv, envp);
+    UnrecoverableError("Execve failed: ", strerror(errno));
+  }
+  // Parent.
+  if (close(p[1]) == -1) {
+    UnrecoverableError("Parent: close failed: ", strerror(errno));
+  }
+  descriptor = p[0];
+  return true;
+}
+
+// Closes @descriptor, a recording read to its end, and wakes up
+// WaitForRecordingEnd().
+void FinishRecording(int descriptor) {
+  if (close(descriptor) == -1) {
+    UnrecoverableError("Close failed: ", strerror(errno));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    is_recording_finished = true;
+  }
+  recording_end_cv.notify_all();
+}
+
+// Reads sysfs on every `upower --monitor` event. @descriptor is -1 to run
+// upower, or a descriptor with recorded `upower --monitor` output.
+void UpdateLoop(int descriptor) {
+  const bool is_recording = descriptor != -1;
+  bool is_pipe_created = is_recording;
+  int upower_to_me_descriptor = descriptor;
   constexpr int BufferSize = 128;
   char buffer[BufferSize];
+  UpowerMonitorScanner scanner;
   while (true) {
     WaitForNonEmptyCallbacks();
     if (!is_pipe_created) {
-      int p[2];
-      if (pipe(p) != 0) {
-        SetError("Couldn't create a pipe: " + std::string(strerror(errno)));
-        std::this_thread::sleep_for(std::chrono::seconds(ErrorWaitSeconds));
-        Update();
-        continue;
-      }
-      int pid = fork();
-      if (pid == -1) {
-        SetError("Couldn't fork: " + std::string(strerror(errno)));
-        if (close(p[0]) == -1 or close(p[1]) == -1) {
-          UnrecoverableError("Close failed: ", strerror(errno));
-        }
+      if (!StartUpower("--monitor", upower_to_me_descriptor)) {
         Update();
         std::this_thread::sleep_for(std::chrono::seconds(ErrorWaitSeconds));
         continue;
       }
-      if (pid == 0) {
-        // Child.
-        if (dup2(p[1], 1 /* stdout */) == -1) {
-          UnrecoverableError("Dup2 failed: ", strerror(errno));
-        }
-        if (close(p[0]) == -1) {
-          UnrecoverableError("Close failed: ", strerror(errno));
-        }
-        char* const envp[] = {NULL};
-        char* const argv[] = {"/usr/bin/upower", "--monitor", NULL};
-        execve(argv[0], argv, envp);
-        UnrecoverableError("Execve failed: ", strerror(errno));
-      }
-      // Parent.
-      if (close(p[1]) == -1) {
-        UnrecoverableError("Parent: close failed: ", strerror(errno));
-      }
       is_pipe_created = true;
-      upower_to_me_descriptor = p[0];
     }
     assert(is_pipe_created);
     fd_set set;
@@ -326,6 +713,8 @@ void UpdateLoop() {
     timeout.tv_usec = 0;
     const int rv =
         select(upower_to_me_descriptor + 1, &set, NULL, NULL, &timeout);
+    // Everything until the next select() is caused by this wakeup.
+    StartTraceCorrelation();
     if (rv == -1) {
       // Error.
       SetError("Select failed: " + std::string(strerror(errno)));
@@ -336,34 +725,115 @@ void UpdateLoop() {
       Update();
     } else {
       // Can read.
+      const long long read_begin_ns = TraceBeginNs();
       const int read_result = read(upower_to_me_descriptor, buffer, BufferSize);
+      TraceSpan("upower event", read_begin_ns);
       if (read_result == -1) {
         SetError("Read failed: " + std::string(strerror(errno)));
         Update();
         std::this_thread::sleep_for(std::chrono::seconds(ErrorWaitSeconds));
       } else if (read_result == 0) {
-        // The child process should never terminate.
-        UnrecoverableError("The child stopped sending data.");
+        if (!is_recording) {
+          // The child process should never terminate.
+          UnrecoverableError("The child stopped sending data.");
+        }
+        FinishRecording(upower_to_me_descriptor);
+        return;
       } else {
+        // A battery may have come or gone. Plain "device changed:" events
+        // come with every energy update, so they leave the cached details to
+        // their TTL.
+        if (scanner.Feed(buffer, read_result) > 0) {
+          sysfs_reader.is_rescan_needed = true;
+          InvalidateBatteryDetails();
+        }
         Update();
       }
     }
   }
 }
 
-std::string RunTlpStat() {
+// Hands @bii to every subscriber without waiting for any of them.
+void Publish(std::shared_ptr<const BatteryInfoInternal> bii) {
+  TraceScope trace("Publish");
+  std::lock_guard<std::mutex> lock(mutex);
+  const auto now = std::chrono::steady_clock::now();
+  const long long now_ns = TraceBeginNs();
+  for (const auto& callback_pair : callbacks) {
+    Subscriber& subscriber = *callback_pair.second;
+    if (subscriber.pending != nullptr) {
+      // The subscriber hasn't seen the previous snapshot yet, and never will.
+      subscriber.dropped++;
+    } else if (!subscriber.is_running) {
+      ready_subscribers.push_back(callback_pair.second);
+    }
+    subscriber.pending = bii;
+    subscriber.pending_since = now;
+    subscriber.pending_since_ns = now_ns;
+  }
+  latest_bii = std::move(bii);
+  dispatch_cv.notify_all();
+}
+
+void DispatchLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    while (ready_subscribers.empty()) {
+      dispatch_cv.wait(lock);
+    }
+    std::shared_ptr<Subscriber> subscriber =
+        std::move(ready_subscribers.front());
+    ready_subscribers.erase(ready_subscribers.begin());
+    std::shared_ptr<const BatteryInfoInternal> bii =
+        std::move(subscriber->pending);
+    subscriber->pending = nullptr;
+    const auto pending_since = subscriber->pending_since;
+    const long long pending_since_ns = subscriber->pending_since_ns;
+    subscriber->is_running = true;
+    subscriber->running_thread = std::this_thread::get_id();
+    lock.unlock();
+    SetTraceCorrelationId(bii->correlation_id);
+    TraceSpan("dispatch queue", pending_since_ns);
+    {
+      TraceScope trace("callback");
+      subscriber->callback(&bii->bi, subscriber->data);
+    }
+    bii = nullptr;
+    const auto lag = std::chrono::steady_clock::now() - pending_since;
+    lock.lock();
+    subscriber->is_running = false;
+    subscriber->delivered++;
+    subscriber->last_lag_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(lag).count();
+    subscriber->max_lag_us =
+        std::max(subscriber->max_lag_us, subscriber->last_lag_us);
+    if (subscriber->pending != nullptr and !subscriber->is_unregistered) {
+      ready_subscribers.push_back(subscriber);
+    }
+    subscriber_idle_cv.notify_all();
+    if (is_recording_finished) {
+      recording_end_cv.notify_all();
+    }
+  }
+}
+
+// Runs @argv[0] and replaces @output with its whole output. Returns false
+// and sets @error if it couldn't be run; the caller decides whether that
+// stops the updates.
+bool RunCommand(char* const argv[], std::string& output, std::string& error) {
+  output.clear();
   int p[2];
   if (pipe(p) != 0) {
-    SetError("Pipe failed: " + std::string(strerror(errno)));
-    return std::string();
+    error = "Pipe failed: " + std::string(strerror(errno));
+    return false;
   }
   const int pid = fork();
   if (pid == -1) {
-    SetError("Fork failed: " + std::string(strerror(errno)));
+    error = "Fork failed: " + std::string(strerror(errno));
     if (close(p[0]) == -1 or close(p[1]) == -1) {
       UnrecoverableError("Close failed: ", strerror(errno));
     }
-    return std::string();
+    return false;
   }
   if (pid == 0) {
     // Child.
@@ -374,10 +844,6 @@ std::string RunTlpStat() {
       UnrecoverableError("Child: close failed: ", strerror(errno));
     }
     char* const envp[] = {NULL};
-    char* const argv[] = {
-        "/usr/bin/tlp-stat-without-sudo",
-        "-b",
-        NULL};
     execve(argv[0], argv, envp);
     UnrecoverableError("Execve failed: ", strerror(errno));
   }
@@ -385,7 +851,6 @@ std::string RunTlpStat() {
   if (close(p[1]) == -1) {
     UnrecoverableError("Parent: close failed: ", strerror(errno));
   }
-  std::string output;
   constexpr int BufferSize = 256;
   char buffer[BufferSize];
   while (true) {
@@ -405,39 +870,269 @@ std::string RunTlpStat() {
   if (waitpid(pid, NULL /* Status */, 0 /* Flags */) == -1) {
     UnrecoverableError("Waitpid failed: ", strerror(errno));
   }
-  return output;
+  return true;
+}
+
+bool RunTlpStat(std::string& output, std::string& error) {
+  char* const argv[] = {
+      "/usr/bin/tlp-stat-without-sudo",
+      "-b",
+      NULL};
+  return RunCommand(argv, output, error);
+}
+
+// Snapshots are recycled once nobody else holds them, so that after the first
+// few updates none are allocated. Normally there are just two: the latest
+// snapshot and the one being filled. Only used by the update thread.
+std::vector<std::shared_ptr<BatteryInfoInternal>> bii_pool;
+
+std::shared_ptr<BatteryInfoInternal> AcquireBatteryInfoInternal() {
+  for (const auto& bii : bii_pool) {
+    if (bii.use_count() == 1) {
+      // The last subscriber has let go of it; see its reads before we write.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return bii;
+    }
+  }
+  bii_pool.push_back(std::make_shared<BatteryInfoInternal>());
+  return bii_pool.back();
+}
+
+// The statuses in the last sysfs update. Only used by the update thread.
+std::vector<BatteryStatus> sysfs_statuses;
+
+// Returns true if a status differs from the last update (eg. the charger was
+// plugged in), which may change the charge thresholds in the details.
+bool HaveStatusesChanged(const std::vector<SingleBatteryInfoInternal>& sbiis) {
+  bool has_changed = sbiis.size() != sysfs_statuses.size();
+  sysfs_statuses.resize(sbiis.size());
+  for (size_t i = 0; i < sbiis.size(); i++) {
+    if (sysfs_statuses[i] != sbiis[i].status) {
+      has_changed = true;
+      sysfs_statuses[i] = sbiis[i].status;
+    }
+  }
+  return has_changed;
 }
 
 void Update() {
+  TraceScope trace("Update");
   std::string tmp_error;
   if (GetError(tmp_error)) {
     std::lock_guard<std::mutex> lock(mutex);
     std::cerr << "error = " << tmp_error << std::endl;
   } else {
-    std::string output = RunTlpStat();
+    std::shared_ptr<BatteryInfoInternal> bii = AcquireBatteryInfoInternal();
+    MakeBatteryInfoInternal(*bii);
+    bii->correlation_id = GetTraceCorrelationId();
     if (GetError(tmp_error)) {
       std::lock_guard<std::mutex> lock(mutex);
-      std::cerr << "tlp-stat error = " << tmp_error << std::endl;
+      std::cerr << "sysfs error = " << tmp_error << std::endl;
     } else {
-      BatteryInfoInternal bii = MakeBatteryInfoInternal(std::move(output));
-      std::set<std::pair<BatteryInfoCallback, void*>> processed_callbacks;
-      auto GetNextCallback = [&processed_callbacks]()
-          -> std::pair<BatteryInfoCallback, void*> {
-        std::lock_guard<std::mutex> lock(mutex);
-        for (const auto& callback_pair : callbacks) {
-          if (processed_callbacks.find(callback_pair) == processed_callbacks.end()) {
-            processed_callbacks.insert(callback_pair);
-            return callback_pair;
-          }
-        }
-        return std::make_pair(nullptr, nullptr);
-      };
-      while (true) {
-        auto callback_pair = GetNextCallback();
-        if (callback_pair.first == nullptr) {
-          break;
-        }
-        callback_pair.first(&bii.bi, callback_pair.second);
+      if (HaveStatusesChanged(bii->sbiis)) {
+        InvalidateBatteryDetails();
+      }
+      Publish(std::move(bii));
+    }
+  }
+}
+
+constexpr int DetailsTtlSeconds = 600;
+
+// The last details from tlp-stat. Guarded by the mutex.
+std::vector<SingleBatteryInfoInternal> details_sbiis;
+std::chrono::steady_clock::time_point details_fetched_at;
+bool has_details = false;
+bool is_fetching_details = false;
+// Bumped by every power supply event; details fetched before that are stale.
+int details_generation = 0;
+int fetched_details_generation = 0;
+std::condition_variable details_cv;
+
+void FetchBatteryDetails(int generation, unsigned long long correlation_id) {
+  SetTraceCorrelationId(correlation_id);
+  std::string output;
+  std::string fetch_error;
+  std::vector<SingleBatteryInfoInternal> sbiis;
+  bool is_run;
+  {
+    TraceScope trace("tlp-stat");
+    is_run = RunTlpStat(output, fetch_error);
+  }
+  if (!is_run) {
+    // The details are optional: the updates go on, and the next request
+    // tries again.
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cerr << "details error = " << fetch_error << std::endl;
+    is_fetching_details = false;
+    details_cv.notify_all();
+    return;
+  }
+  {
+    TraceScope trace("parse tlp-stat");
+    ParseTlpStatOutput(output, sbiis);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  details_sbiis.swap(sbiis);
+  details_fetched_at = std::chrono::steady_clock::now();
+  fetched_details_generation = generation;
+  has_details = true;
+  is_fetching_details = false;
+  details_cv.notify_all();
+}
+
+// Starts fetching the details in the background, unless they are fresh.
+// The mutex must be held.
+void RefreshBatteryDetailsIfStale() {
+  if (is_fetching_details) {
+    return;
+  }
+  if (has_details and fetched_details_generation == details_generation and
+      std::chrono::steady_clock::now() - details_fetched_at <
+          std::chrono::seconds(DetailsTtlSeconds)) {
+    return;
+  }
+  is_fetching_details = true;
+  std::thread(FetchBatteryDetails, details_generation,
+              GetTraceCorrelationId()).detach();
+}
+
+void InvalidateBatteryDetails() {
+  std::lock_guard<std::mutex> lock(mutex);
+  details_generation++;
+}
+
+int CopyBatteryDetails(const char* id, BatteryDetails* details, bool wait) {
+  std::unique_lock<std::mutex> lock(mutex);
+  RefreshBatteryDetailsIfStale();
+  while (wait and is_fetching_details) {
+    details_cv.wait(lock);
+  }
+  // @id may be truncated.
+  constexpr size_t IdLength = sizeof(SingleBatteryInfo().id) - 1;
+  for (const SingleBatteryInfoInternal& sbii : details_sbiis) {
+    if (strncmp(sbii.id.c_str(), id, IdLength) == 0) {
+      *details = sbii.details;
+      details->age_seconds = static_cast<int>(
+          std::chrono::duration_cast<std::chrono::seconds>(
+              std::chrono::steady_clock::now() - details_fetched_at).count());
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// The batteries last reported by upower, by object path. Only used by the
+// update thread.
+std::map<std::string, SingleBatteryInfoInternal> upower_batteries;
+
+// Upower reports every energy update as a change, so the cached details are
+// invalidated only when a battery comes, goes or changes its status.
+void StoreUpowerRecord(const UpowerBatteryRecord& record) {
+  if (record.is_removed) {
+    if (upower_batteries.erase(record.path) > 0) {
+      InvalidateBatteryDetails();
+    }
+    return;
+  }
+  auto it = upower_batteries.find(record.path);
+  const bool is_new = it == upower_batteries.end();
+  if (is_new) {
+    it = upower_batteries.emplace(record.path,
+                                  SingleBatteryInfoInternal()).first;
+  }
+  const BatteryStatus previous_status = it->second.status;
+  AnalizeBatteryFromUpowerRecord(record, it->second);
+  if (is_new or it->second.status != previous_status) {
+    InvalidateBatteryDetails();
+  }
+}
+
+void PublishUpowerBatteries() {
+  TraceScope trace("Update");
+  std::string tmp_error;
+  if (GetError(tmp_error)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cerr << "error = " << tmp_error << std::endl;
+    return;
+  }
+  std::shared_ptr<BatteryInfoInternal> bii = AcquireBatteryInfoInternal();
+  bii->error.clear();
+  // Assigning to the existing elements reuses their strings.
+  bii->sbiis.resize(upower_batteries.size());
+  auto sbii_it = bii->sbiis.begin();
+  for (const auto& path_and_sbii : upower_batteries) {
+    *sbii_it++ = path_and_sbii.second;
+  }
+  MakeExternalBatteryInfo(*bii);
+  bii->correlation_id = GetTraceCorrelationId();
+  Publish(std::move(bii));
+}
+
+// Unlike UpdateLoop(), reads the values from upower instead of only waking up
+// on its events, so nothing is spawned after the start. @descriptor is -1 to
+// run upower, or a descriptor with recorded `upower --monitor-detail` output.
+void UpowerUpdateLoop(int descriptor) {
+  const bool is_recording = descriptor != -1;
+  bool has_new_records = false;
+  UpowerMonitorParser parser(
+      [&has_new_records](const UpowerBatteryRecord& record) {
+        StoreUpowerRecord(record);
+        has_new_records = true;
+      });
+  constexpr int BufferSize = 4096;
+  char buffer[BufferSize];
+  while (true) {
+    WaitForNonEmptyCallbacks();
+    if (descriptor == -1) {
+      // The monitor only prints changes, so the starting values come from
+      // a dump.
+      char* const argv[] = {"/usr/bin/upower", "--dump", NULL};
+      std::string dump;
+      std::string run_error;
+      if (!RunCommand(argv, dump, run_error)) {
+        SetError(run_error);
+      }
+      parser.Feed(dump.data(), dump.size());
+      parser.Finish();
+      has_new_records = false;
+      if (!StartUpower("--monitor-detail", descriptor)) {
+        PublishUpowerBatteries();
+        std::this_thread::sleep_for(std::chrono::seconds(ErrorWaitSeconds));
+        continue;
+      }
+      PublishUpowerBatteries();
+    }
+    const int read_result = read(descriptor, buffer, BufferSize);
+    // The read blocks until upower prints something, so the event is only
+    // marked when it arrives.
+    StartTraceCorrelation();
+    TraceSpan("upower event", TraceBeginNs());
+    if (read_result == -1) {
+      SetError("Read failed: " + std::string(strerror(errno)));
+      PublishUpowerBatteries();
+      std::this_thread::sleep_for(std::chrono::seconds(ErrorWaitSeconds));
+    } else if (read_result == 0) {
+      if (!is_recording) {
+        // The child process should never terminate.
+        UnrecoverableError("The child stopped sending data.");
+      }
+      parser.Finish();
+      if (has_new_records) {
+        PublishUpowerBatteries();
+      }
+      FinishRecording(descriptor);
+      return;
+    } else {
+      {
+        TraceScope trace("parse upower");
+        parser.Feed(buffer, read_result);
+      }
+      // One read usually carries a whole event, so the snapshot is published
+      // once per read rather than once per battery.
+      if (has_new_records) {
+        has_new_records = false;
+        PublishUpowerBatteries();
       }
     }
   }
@@ -445,12 +1140,140 @@ void Update() {
 
 void InsertCallback(BatteryInfoCallback callback, void* data) {
   std::lock_guard<std::mutex> lock(mutex);
-  callbacks.emplace(callback, data);
+  auto subscriber = std::make_shared<Subscriber>();
+  subscriber->callback = callback;
+  subscriber->data = data;
+  if (latest_bii != nullptr) {
+    subscriber->pending = latest_bii;
+    subscriber->pending_since = std::chrono::steady_clock::now();
+    subscriber->pending_since_ns = TraceBeginNs();
+    ready_subscribers.push_back(subscriber);
+    dispatch_cv.notify_all();
+  }
+  callbacks.emplace(std::make_pair(callback, data), std::move(subscriber));
   cv.notify_one();
 }
 
+void EraseCallback(BatteryInfoCallback callback, void* data) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = callbacks.find(std::make_pair(callback, data));
+  if (it == callbacks.end()) {
+    return;
+  }
+  std::shared_ptr<Subscriber> subscriber = std::move(it->second);
+  callbacks.erase(it);
+  subscriber->is_unregistered = true;
+  subscriber->pending = nullptr;
+  ready_subscribers.erase(
+      std::remove(ready_subscribers.begin(), ready_subscribers.end(),
+                  subscriber),
+      ready_subscribers.end());
+  // The caller may free @data as soon as we return, so wait for a running
+  // callback to finish, unless it is the one unregistering itself.
+  while (subscriber->is_running and
+         subscriber->running_thread != std::this_thread::get_id()) {
+    subscriber_idle_cv.wait(lock);
+  }
+}
+
+// The mutex must be held.
+bool AreSubscribersIdle() {
+  for (const auto& callback_pair : callbacks) {
+    const Subscriber& subscriber = *callback_pair.second;
+    if (subscriber.pending != nullptr or subscriber.is_running) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void WaitForRecordingEnd() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!is_recording_finished or !AreSubscribersIdle()) {
+    recording_end_cv.wait(lock);
+  }
+}
+
+int CollectCallbackStats(BatteryCallbackStats* stats, int max_stats) {
+  std::lock_guard<std::mutex> lock(mutex);
+  int i = 0;
+  for (const auto& callback_pair : callbacks) {
+    if (i < max_stats) {
+      const Subscriber& subscriber = *callback_pair.second;
+      BatteryCallbackStats& s = stats[i];
+      s.callback = subscriber.callback;
+      s.data = subscriber.data;
+      s.delivered = subscriber.delivered;
+      s.dropped = subscriber.dropped;
+      s.last_lag_us = subscriber.last_lag_us;
+      s.max_lag_us = subscriber.max_lag_us;
+      s.is_pending = subscriber.pending != nullptr ? 1 : 0;
+    }
+    i++;
+  }
+  return i;
+}
+
+// Grows @*buffer to at least @size bytes. With realloc() rather than new,
+// as BatteryInfoCopy is a C struct.
+bool Reserve(void** buffer, size_t* capacity, size_t size) {
+  if (size <= *capacity) {
+    return true;
+  }
+  void* new_buffer = realloc(*buffer, size);
+  if (new_buffer == NULL) {
+    return false;
+  }
+  *buffer = new_buffer;
+  *capacity = size;
+  return true;
+}
+
 }  // namespace
 
+void InitializeBatteryInfoCopy(BatteryInfoCopy* bic) {
+  bic->bi.error = NULL;
+  bic->bi.number_of_batteries = 0;
+  bic->bi.sbis = NULL;
+  bic->bi.minutes_left = -1;
+  bic->error_buffer = NULL;
+  bic->error_capacity = 0;
+  bic->sbis_capacity = 0;
+}
+
+void ClearBatteryInfoCopy(BatteryInfoCopy* bic) {
+  free(bic->error_buffer);
+  free(bic->bi.sbis);
+  InitializeBatteryInfoCopy(bic);
+}
+
+void CopyBatteryInfo(const BatteryInfo* src, BatteryInfoCopy* dst) {
+  if (src->error == NULL) {
+    dst->bi.error = NULL;
+  } else {
+    const size_t size = strlen(src->error) + 1;
+    if (!Reserve(reinterpret_cast<void**>(&dst->error_buffer),
+                 &dst->error_capacity, size)) {
+      ClearBatteryInfoCopy(dst);
+      return;
+    }
+    memcpy(dst->error_buffer, src->error, size);
+    dst->bi.error = dst->error_buffer;
+  }
+  const int len = src->number_of_batteries;
+  if (!Reserve(reinterpret_cast<void**>(&dst->bi.sbis), &dst->sbis_capacity,
+               len * sizeof(SingleBatteryInfo))) {
+    ClearBatteryInfoCopy(dst);
+    return;
+  }
+  dst->bi.number_of_batteries = len;
+  // May be NULL when there are no batteries.
+  if (len > 0) {
+    memcpy(dst->bi.sbis, src->sbis, len * sizeof(SingleBatteryInfo));
+  }
+  dst->bi.minutes_left = src->minutes_left;
+}
+
 void RegisterCallback(BatteryInfoCallback callback, void* data) {
   TryInit();
   InsertCallback(callback, data);
@@ -458,6 +1281,52 @@ void RegisterCallback(BatteryInfoCallback callback, void* data) {
 }
 
 void UnregisterCallback(BatteryInfoCallback callback, void* data) {
+  EraseCallback(callback, data);
+}
+
+int GetBatteryCallbackStats(BatteryCallbackStats* stats, int max_stats) {
+  return CollectCallbackStats(stats, max_stats);
+}
+
+void WaitForUpowerRecordingEnd(void) {
+  WaitForRecordingEnd();
+}
+
+int ReadBatteryInfo(BatteryInfoCallback callback, void* data) {
+  constexpr int BatteryRescanSeconds = 600;
+  // Separate from the update thread's state, as both may run at once.
+  static std::mutex read_mutex;
+  static SysfsReader reader;
+  static BatteryInfoInternal bii;
+  std::lock_guard<std::mutex> lock(read_mutex);
+  StartTraceCorrelation();
+  TraceScope trace("ReadBatteryInfo");
+  // No events come here.
+  if (std::chrono::steady_clock::now() - reader.scanned_at >
+      std::chrono::seconds(BatteryRescanSeconds)) {
+    reader.is_rescan_needed = true;
+  }
+  bii.error.clear();
+  const bool is_read = ReadSysfsBatteries(reader, bii.sbiis, bii.error);
+  MakeExternalBatteryInfo(bii);
+  callback(&bii.bi, data);
+  return is_read ? 0 : -1;
+}
+
+int GetBatteryDetails(const char* id, BatteryDetails* details) {
+  return CopyBatteryDetails(id, details, false);
+}
+
+int GetFreshBatteryDetails(const char* id, BatteryDetails* details) {
+  return CopyBatteryDetails(id, details, true);
+}
+
+void SetBatteryInfoBackend(BatteryInfoBackend new_backend) {
+  std::lock_guard<std::mutex> lock(mutex);
+  backend = new_backend;
+}
+
+void SetUpowerMonitorDescriptor(int descriptor) {
   std::lock_guard<std::mutex> lock(mutex);
-  callbacks.erase(std::make_pair(callback, data));
+  upower_monitor_descriptor = descriptor;
 }
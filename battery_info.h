@@ -1,6 +1,8 @@
 #ifndef BATTERY_INFO_H_
 #define BATTERY_INFO_H_
 
+#include <stddef.h>
+
 #if __cplusplus
 extern "C" {
 #endif
@@ -13,6 +15,8 @@ typedef enum {
 } BatteryStatus;
 
 typedef struct {
+  // The sysfs name (eg. BAT0), truncated to 31 characters.
+  char id[32];
   // The % of battery left: [0, 100].
   double charge;
   BatteryStatus status;
@@ -33,9 +37,114 @@ typedef struct {
 
 typedef void (*BatteryInfoCallback)(const BatteryInfo*, void*);
 
+// A copy of a BatteryInfo that keeps its buffers between updates, so that
+// copying an update allocates only when there are more batteries or a longer
+// error than ever before. For callers that keep the last update around (eg.
+// the panel plugin).
+typedef struct {
+  BatteryInfo bi;
+  // @bi.error is either NULL or @error_buffer.
+  char* error_buffer;
+  // In bytes.
+  size_t error_capacity;
+  size_t sbis_capacity;
+} BatteryInfoCopy;
+
+void InitializeBatteryInfoCopy(BatteryInfoCopy* bic);
+// Frees the buffers and leaves @bic empty, as after initialization.
+void ClearBatteryInfoCopy(BatteryInfoCopy* bic);
+// Copies @src into @dst. If a buffer can't grow, @dst is cleared instead.
+void CopyBatteryInfo(const BatteryInfo* src, BatteryInfoCopy* dst);
+
+typedef enum {
+  // Reads sysfs whenever `upower --monitor` reports an event, and at least
+  // every 20 seconds.
+  kSysfsBackend = 0,
+  // Parses the values streamed by `upower --monitor-detail`.
+  kUpowerBackend = 1,
+} BatteryInfoBackend;
+
+// Both take effect only if called before the first RegisterCallback().
+void SetBatteryInfoBackend(BatteryInfoBackend backend);
+// Makes the backend read the output of upower from @descriptor (eg. a
+// recording fed through a pipe) instead of running upower: `upower
+// --monitor-detail` for the upower backend, and `upower --monitor` for the
+// sysfs one, which reads sysfs on every event it finds there.
+void SetUpowerMonitorDescriptor(int descriptor);
+// Blocks until the backend has read the recording set with
+// SetUpowerMonitorDescriptor() to its end, and every callback has run with
+// the last update. Never returns without a recording.
+void WaitForUpowerRecordingEnd(void);
+
 void RegisterCallback(BatteryInfoCallback callback, void* data);
 void UnregisterCallback(BatteryInfoCallback callback, void* data);
 
+// Reads sysfs right away on the calling thread, without starting the
+// background updates, and runs @callback with the result before returning.
+// Nothing tells it about batteries coming and going, so it looks for them
+// again every 10 minutes, which allocates; the other calls don't.
+// Returns 0 on success, -1 if sysfs couldn't be read.
+int ReadBatteryInfo(BatteryInfoCallback callback, void* data);
+
+typedef struct {
+  BatteryInfoCallback callback;
+  void* data;
+
+  // The number of times the callback was run.
+  long long delivered;
+
+  // The number of updates replaced by a newer one before the callback could
+  // see them.
+  long long dropped;
+
+  // The time from publishing an update until the callback returned, in
+  // microseconds: for the most recent run and the slowest one so far.
+  long long last_lag_us;
+  long long max_lag_us;
+
+  // 1 if an update is waiting for the callback right now, 0 otherwise.
+  int is_pending;
+} BatteryCallbackStats;
+
+// Fills at most @max_stats entries of @stats, one per registered callback.
+// Returns the number of registered callbacks.
+int GetBatteryCallbackStats(BatteryCallbackStats* stats, int max_stats);
+
+// Details that change rarely or need root, so they are not part of the
+// regular updates. They come from tlp-stat.
+typedef struct {
+  // Empty if unknown.
+  char manufacturer[32];
+  char model_name[32];
+
+  // -1 if unknown.
+  int cycle_count;
+
+  // In mWh, -1 if unknown.
+  int energy_full;
+  int energy_full_design;
+
+  // The charge thresholds in %, -1 if unknown (eg. tlp-stat ran without root).
+  int start_threshold;
+  int stop_threshold;
+
+  // 1 if the battery is forced to discharge, 0 if not, -1 if unknown.
+  int force_discharge;
+
+  // The number of seconds since the details were read.
+  int age_seconds;
+} BatteryDetails;
+
+// Copies the details of the battery with the @id of a SingleBatteryInfo, so
+// that a caller holding an older BatteryInfo still gets the right battery.
+// Returns 0 on success, -1 if they aren't known yet. Never blocks: details
+// older than 10 minutes, or from before a power supply event, are refreshed
+// in the background and returned as they are in the meantime.
+int GetBatteryDetails(const char* id, BatteryDetails* details);
+
+// Like GetBatteryDetails(), but waits for a refresh if one is needed.
+int GetFreshBatteryDetails(const char* id, BatteryDetails* details);
+
 #if __cplusplus
 }  // extern "C"
 #endif
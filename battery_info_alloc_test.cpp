@@ -0,0 +1,240 @@
+// Checks that once warmed up, an update makes no allocation on its way from
+// a backend through Update(), Publish() and the dispatch threads to a
+// callback that keeps it with CopyBatteryInfo(), as the panel plugin does.
+// The argument picks the backend:
+//
+// upower: `upower --monitor-detail` events carry the values.
+// sysfs: `upower --monitor` events make the backend read a battery in the
+//        fake sysfs tree, whose energy_now the test changes.
+//
+// The events come through a pipe set with SetUpowerMonitorDescriptor();
+// malloc, calloc and realloc are interposed to count allocations, which also
+// catches operator new.
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+#include "battery_info.h"
+#include "fake_root.h"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+}
+
+namespace {
+
+constexpr int WarmUpUpdates = 50;
+constexpr int CheckedUpdates = 500;
+constexpr long long DeliveryTimeoutNs = 5000000000LL;
+constexpr char EnergyNowPath[] = POWER_SUPPLY_PATH "/BAT0/energy_now";
+
+std::atomic<bool> is_counting(false);
+std::atomic<long long> allocations(0);
+std::atomic<int> delivered(0);
+// Only used by the callback, which never runs on two threads at once.
+BatteryInfoCopy battery_info;
+
+void CountAllocation() {
+  if (is_counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+long long MonotonicNowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void CopyingCallback(const BatteryInfo* bi, void* data) {
+  CopyBatteryInfo(bi, &battery_info);
+  delivered.fetch_add(1, std::memory_order_release);
+}
+
+// Formats an event for BAT0 with @energy_wh, before anything is counted.
+std::string MakeDetailEvent(double energy_wh) {
+  char event[512];
+  snprintf(event, sizeof(event),
+           "[10:20:11.521]\tdevice changed:     "
+           "/org/freedesktop/UPower/devices/battery_BAT0\n"
+           "  native-path:          BAT0\n"
+           "  model:                45N1773\n"
+           "  battery\n"
+           "    state:               discharging\n"
+           "    energy:              %.2lf Wh\n"
+           "    energy-full:         24.61 Wh\n"
+           "    energy-rate:         4.416 W\n"
+           "\n",
+           energy_wh);
+  return event;
+}
+
+// Sends updates for one backend. The values alternate, so that every update
+// differs from the last one.
+class UpdateSource {
+ public:
+  virtual ~UpdateSource() {}
+  // Prepares whatever update @i needs besides the event.
+  virtual bool Prepare(int i) = 0;
+  virtual const std::string& Event(int i) const = 0;
+};
+
+class UpowerSource : public UpdateSource {
+ public:
+  UpowerSource() : events_{MakeDetailEvent(14.79), MakeDetailEvent(14.5)} {}
+
+  bool Prepare(int i) override {
+    return true;
+  }
+
+  const std::string& Event(int i) const override {
+    return events_[i % 2];
+  }
+
+ private:
+  const std::string events_[2];
+};
+
+class SysfsSource : public UpdateSource {
+ public:
+  SysfsSource()
+      : event_("[10:20:11.521]\tdevice changed:     "
+               "/org/freedesktop/UPower/devices/battery_BAT0\n") {
+    RemoveFakeRoot();
+    WriteFakeBattery("BAT0", 14790000, 24610000, 4416000, "Discharging");
+    energy_now_fd_ = open(EnergyNowPath, O_WRONLY | O_CLOEXEC);
+  }
+
+  ~SysfsSource() override {
+    if (energy_now_fd_ != -1) {
+      close(energy_now_fd_);
+    }
+    RemoveFakeRoot();
+  }
+
+  // Both values have the same length, so they overwrite each other whole.
+  bool Prepare(int i) override {
+    static const char* const values[2] = {"14790000\n", "14500000\n"};
+    const size_t size = strlen(values[i % 2]);
+    return pwrite(energy_now_fd_, values[i % 2], size, 0) ==
+           static_cast<ssize_t>(size);
+  }
+
+  const std::string& Event(int i) const override {
+    return event_;
+  }
+
+ private:
+  const std::string event_;
+  int energy_now_fd_;
+};
+
+// Sends update @i and waits for the callback to see it. The backends
+// publish once per read, and the callback is run once per publish unless a
+// newer snapshot replaces the pending one, which waiting here rules out.
+bool SendUpdate(int descriptor, UpdateSource& source, int i) {
+  const int target = delivered.load(std::memory_order_acquire) + 1;
+  const std::string& event = source.Event(i);
+  if (!source.Prepare(i) or
+      write(descriptor, event.data(), event.size()) !=
+          static_cast<ssize_t>(event.size())) {
+    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+    return false;
+  }
+  const long long deadline_ns = MonotonicNowNs() + DeliveryTimeoutNs;
+  while (delivered.load(std::memory_order_acquire) < target) {
+    if (MonotonicNowNs() > deadline_ns) {
+      fprintf(stderr, "The update wasn't delivered\n");
+      return false;
+    }
+    const timespec pause = {0, 100000};
+    nanosleep(&pause, NULL);
+  }
+  return true;
+}
+
+// Returns the number of allocations in the checked updates, or -1 if an
+// update got lost.
+long long CountUpdateAllocations(UpdateSource& source) {
+  int p[2];
+  if (pipe(p) != 0) {
+    fprintf(stderr, "Pipe failed: %s\n", strerror(errno));
+    return -1;
+  }
+  SetUpowerMonitorDescriptor(p[0]);
+  InitializeBatteryInfoCopy(&battery_info);
+  RegisterCallback(CopyingCallback, NULL);
+  for (int i = 0; i < WarmUpUpdates; i++) {
+    if (!SendUpdate(p[1], source, i)) {
+      return -1;
+    }
+  }
+  is_counting = true;
+  for (int i = 0; i < CheckedUpdates; i++) {
+    if (!SendUpdate(p[1], source, i)) {
+      return -1;
+    }
+  }
+  is_counting = false;
+  if (battery_info.bi.number_of_batteries != 1) {
+    fprintf(stderr, "The copy has %d batteries instead of 1\n",
+            battery_info.bi.number_of_batteries);
+    return -1;
+  }
+  return allocations;
+}
+
+}  // namespace
+
+extern "C" void* malloc(size_t size) {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  CountAllocation();
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+  CountAllocation();
+  return __libc_realloc(pointer, size);
+}
+
+int main(int argc, char** argv) {
+  const std::string backend = argc > 1 ? argv[1] : "";
+  long long result;
+  if (backend == "upower") {
+    SetBatteryInfoBackend(kUpowerBackend);
+    UpowerSource source;
+    result = CountUpdateAllocations(source);
+  } else if (backend == "sysfs") {
+    SetBatteryInfoBackend(kSysfsBackend);
+    SysfsSource source;
+    result = CountUpdateAllocations(source);
+  } else {
+    fprintf(stderr, "Usage: %s upower|sysfs\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (result == -1) {
+    return EXIT_FAILURE;
+  }
+  if (result > 0) {
+    fprintf(stderr,
+            "battery_info_alloc_test %s: %lld allocations in %d updates\n",
+            backend.c_str(), result, CheckedUpdates);
+    return EXIT_FAILURE;
+  }
+  printf("battery_info_alloc_test %s: OK, no allocations in %d updates\n",
+         backend.c_str(), CheckedUpdates);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,269 @@
+#include "energy_meter.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "power_supply.h"
+#include "spsc_ring.h"
+
+namespace {
+
+constexpr int DefaultSamplingHz = 50;
+constexpr int MaxSamplingHz = 1000;
+// About three minutes of samples at 100 Hz.
+constexpr int RingCapacity = 1 << 14;
+constexpr double NanosecondsPerHour = 3600e9;
+
+// Everything the sampler knows, updated once per sample. A measurement is
+// the difference of two copies of it.
+struct Accumulator {
+  // Changes whenever sampling restarts, as there is a gap in the integral.
+  int generation = 0;
+  bool has_sample = false;
+  // The last sample.
+  PowerSample sample;
+  // Integrated since sampling (re)started.
+  double energy_mwh = 0;
+  double error_mwh = 0;
+  // The largest |power change| between two consecutive samples.
+  double max_power_step_mw = 0;
+  long long number_of_samples = 0;
+  long long not_discharging_samples = 0;
+};
+
+struct MeasurementStart {
+  bool is_used = false;
+  long long time_ns;
+  Accumulator accumulator;
+};
+
+std::mutex control_mutex;
+std::vector<PowerSupplyBattery> batteries;
+std::atomic<bool> is_sampling(false);
+// Never destroyed, so that a process can exit while sampling.
+std::thread* sampler_thread = nullptr;
+long long period_ns;
+
+std::mutex accumulator_mutex;
+Accumulator accumulator;
+std::vector<MeasurementStart> measurement_starts;
+
+SpscRing<PowerSample> samples_ring(RingCapacity);
+std::atomic<long long> dropped_samples(0);
+
+long long MonotonicNowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool TakeSample(PowerSample& sample) {
+  sample.time_ns = MonotonicNowNs();
+  sample.power_mw = 0;
+  sample.energy_now_mwh = 0;
+  sample.is_discharging = 0;
+  bool has_power = false;
+  for (const PowerSupplyBattery& battery : batteries) {
+    long long value;
+    if (ReadSysfsInteger(battery.power_now_fd, value)) {
+      sample.power_mw += value / 1000.0;
+      has_power = true;
+    }
+    if (ReadSysfsInteger(battery.energy_now_fd, value)) {
+      sample.energy_now_mwh += value / 1000.0;
+    }
+    constexpr int BufferSize = 32;
+    char status[BufferSize];
+    if (ReadSysfsString(battery.status_fd, status, BufferSize) and
+        strcmp(status, "Discharging") == 0) {
+      sample.is_discharging = 1;
+    }
+  }
+  return has_power;
+}
+
+// Only the sample ring is lock-free. The accumulator is behind a mutex, so a
+// sample may wait for a BeginEnergyMeasurement() or EndEnergyMeasurement()
+// in progress; they hold it only to copy an Accumulator.
+void Accumulate(const PowerSample& sample) {
+  std::lock_guard<std::mutex> lock(accumulator_mutex);
+  if (accumulator.has_sample) {
+    const PowerSample& previous = accumulator.sample;
+    const double hours = (sample.time_ns - previous.time_ns) /
+                         NanosecondsPerHour;
+    const double step = std::fabs(sample.power_mw - previous.power_mw);
+    // Trapezoid rule. For a monotonic power curve the real area lies between
+    // the two rectangles, which differ from the trapezoid by half the step.
+    accumulator.energy_mwh +=
+        (sample.power_mw + previous.power_mw) / 2 * hours;
+    accumulator.error_mwh += step / 2 * hours;
+    if (step > accumulator.max_power_step_mw) {
+      accumulator.max_power_step_mw = step;
+    }
+  }
+  accumulator.has_sample = true;
+  accumulator.sample = sample;
+  accumulator.number_of_samples++;
+  if (!sample.is_discharging) {
+    accumulator.not_discharging_samples++;
+  }
+}
+
+void SampleLoop() {
+  long long next_ns = MonotonicNowNs();
+  while (is_sampling.load(std::memory_order_relaxed)) {
+    next_ns += period_ns;
+    timespec next;
+    next.tv_sec = next_ns / 1000000000LL;
+    next.tv_nsec = next_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0) {
+      // Interrupted by a signal.
+    }
+    PowerSample sample;
+    if (!TakeSample(sample)) {
+      continue;
+    }
+    Accumulate(sample);
+    if (!samples_ring.Push(sample)) {
+      dropped_samples.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (sample.time_ns - next_ns > period_ns) {
+      // Fell behind (eg. after a suspend), don't try to catch up.
+      next_ns = sample.time_ns;
+    }
+  }
+}
+
+void StopSamplingLocked() {
+  if (sampler_thread == nullptr) {
+    return;
+  }
+  is_sampling = false;
+  sampler_thread->join();
+  delete sampler_thread;
+  sampler_thread = nullptr;
+  ClosePowerSupplyBatteries(batteries);
+  std::lock_guard<std::mutex> lock(accumulator_mutex);
+  accumulator.has_sample = false;
+  accumulator.generation++;
+}
+
+int StartSamplingLocked(int hz) {
+  if (hz <= 0 or hz > MaxSamplingHz) {
+    return -1;
+  }
+  StopSamplingLocked();
+  std::string error;
+  if (!FindPowerSupplyBatteries(batteries, error)) {
+    return -1;
+  }
+  // The first sample is taken here, so that a measurement can begin as soon
+  // as this returns.
+  PowerSample sample;
+  if (!TakeSample(sample)) {
+    ClosePowerSupplyBatteries(batteries);
+    return -1;
+  }
+  Accumulate(sample);
+  period_ns = 1000000000LL / hz;
+  is_sampling = true;
+  sampler_thread = new std::thread(SampleLoop);
+  return 0;
+}
+
+// Energy drawn between the last sample in @accumulator and @time_ns,
+// assuming constant power.
+double Extrapolate(const Accumulator& accumulator, long long time_ns) {
+  return accumulator.sample.power_mw *
+         (time_ns - accumulator.sample.time_ns) / NanosecondsPerHour;
+}
+
+}  // namespace
+
+int StartPowerSampling(int hz) {
+  std::lock_guard<std::mutex> lock(control_mutex);
+  return StartSamplingLocked(hz);
+}
+
+void StopPowerSampling(void) {
+  std::lock_guard<std::mutex> lock(control_mutex);
+  StopSamplingLocked();
+}
+
+int ReadPowerSamples(PowerSample* samples, int max_samples) {
+  int i = 0;
+  while (i < max_samples and samples_ring.Pop(samples[i])) {
+    i++;
+  }
+  return i;
+}
+
+long long GetDroppedPowerSamples(void) {
+  return dropped_samples.load(std::memory_order_relaxed);
+}
+
+int BeginEnergyMeasurement(void) {
+  {
+    std::lock_guard<std::mutex> lock(control_mutex);
+    if (!is_sampling and StartSamplingLocked(DefaultSamplingHz) != 0) {
+      return -1;
+    }
+  }
+  std::lock_guard<std::mutex> lock(accumulator_mutex);
+  int handle = 0;
+  while (handle < static_cast<int>(measurement_starts.size()) and
+         measurement_starts[handle].is_used) {
+    handle++;
+  }
+  if (handle == static_cast<int>(measurement_starts.size())) {
+    measurement_starts.emplace_back();
+  }
+  MeasurementStart& start = measurement_starts[handle];
+  start.is_used = true;
+  start.time_ns = MonotonicNowNs();
+  start.accumulator = accumulator;
+  return handle;
+}
+
+int EndEnergyMeasurement(int handle, EnergyMeasurement* measurement) {
+  std::lock_guard<std::mutex> lock(accumulator_mutex);
+  const long long end_ns = MonotonicNowNs();
+  if (handle < 0 or handle >= static_cast<int>(measurement_starts.size()) or
+      !measurement_starts[handle].is_used) {
+    return -1;
+  }
+  MeasurementStart& start = measurement_starts[handle];
+  start.is_used = false;
+  const Accumulator& begin = start.accumulator;
+  const Accumulator& end = accumulator;
+  if (begin.generation != end.generation or !end.has_sample) {
+    // Sampling was restarted or stopped in the meantime.
+    return -1;
+  }
+  // The integral covers the samples around the interval; the bits between
+  // the interval ends and the nearest earlier samples are extrapolated.
+  const long long begin_gap_ns = start.time_ns - begin.sample.time_ns;
+  const long long end_gap_ns = end_ns - end.sample.time_ns;
+  measurement->duration_s = (end_ns - start.time_ns) / 1e9;
+  measurement->energy_mwh = end.energy_mwh - begin.energy_mwh -
+                            Extrapolate(begin, start.time_ns) +
+                            Extrapolate(end, end_ns);
+  measurement->error_mwh =
+      end.error_mwh - begin.error_mwh +
+      end.max_power_step_mw * (begin_gap_ns + end_gap_ns) /
+          NanosecondsPerHour;
+  measurement->energy_now_delta_mwh =
+      begin.sample.energy_now_mwh - end.sample.energy_now_mwh;
+  measurement->number_of_samples =
+      static_cast<int>(end.number_of_samples - begin.number_of_samples);
+  measurement->is_discharging =
+      begin.sample.is_discharging and
+      end.not_discharging_samples == begin.not_discharging_samples;
+  return 0;
+}
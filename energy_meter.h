@@ -0,0 +1,66 @@
+#ifndef ENERGY_METER_H_
+#define ENERGY_METER_H_
+
+#if __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  // CLOCK_MONOTONIC, in nanoseconds.
+  long long time_ns;
+
+  // Summed over all batteries.
+  double power_mw;
+  double energy_now_mwh;
+
+  // 1 if any battery was discharging, 0 otherwise.
+  int is_discharging;
+} PowerSample;
+
+typedef struct {
+  double duration_s;
+
+  // The energy drawn from the batteries, integrated from power_now.
+  double energy_mwh;
+
+  // An upper bound of |@energy_mwh - the real energy|, assuming the power
+  // changes monotonically between two samples.
+  double error_mwh;
+
+  // The drop of energy_now over the interval. The fuel gauge updates it
+  // rarely, so it's only a coarse cross-check for long intervals.
+  double energy_now_delta_mwh;
+
+  int number_of_samples;
+
+  // 1 if the batteries were discharging during the whole interval. Otherwise
+  // power_now doesn't measure what the machine used.
+  int is_discharging;
+} EnergyMeasurement;
+
+// Starts (or restarts) sampling all batteries @hz times per second, at most
+// 1000. Note that the battery driver may refresh power_now less often.
+// Returns 0 on success, -1 on failure.
+int StartPowerSampling(int hz);
+void StopPowerSampling(void);
+
+// Moves at most @max_samples of the oldest samples into @samples and returns
+// their number. Samples are kept only until the ring fills up; later ones are
+// counted by GetDroppedPowerSamples(). Must not be called concurrently.
+int ReadPowerSamples(PowerSample* samples, int max_samples);
+long long GetDroppedPowerSamples(void);
+
+// Starts sampling at the default rate, unless it is already running.
+// Returns a handle for EndEnergyMeasurement(), or -1 on failure. This and
+// EndEnergyMeasurement() briefly lock out the sampler; `run.e --measure`
+// reports what sampling costs.
+int BeginEnergyMeasurement(void);
+
+// Returns 0 and fills @measurement on success, -1 if @handle is invalid.
+int EndEnergyMeasurement(int handle, EnergyMeasurement* measurement);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // ENERGY_METER_H_
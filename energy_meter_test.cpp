@@ -0,0 +1,167 @@
+// Measures a fake battery whose power_now the test sets, and checks the
+// integral, its extrapolation to the ends of the interval and the error bound
+// against the energy that was really drawn.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "energy_meter.h"
+#include "fake_root.h"
+
+namespace {
+
+constexpr long long EnergyFullUwh = 24000000;
+constexpr long long EnergyNowUwh = 20000000;
+constexpr double NanosecondsPerHour = 3600e9;
+constexpr long long IntervalNs = 200000000;
+// Rounding only: a constant power is integrated exactly.
+constexpr double Epsilon = 1e-9;
+
+int failures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    fprintf(stderr, "energy_meter_test: %s\n", what);
+    failures++;
+  }
+}
+
+long long MonotonicNowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void Sleep(long long ns) {
+  const timespec pause = {static_cast<time_t>(ns / 1000000000LL),
+                          static_cast<long>(ns % 1000000000LL)};
+  nanosleep(&pause, NULL);
+}
+
+// Energy in mWh drawn at @power_uw for @ns.
+double EnergyMwh(long long power_uw, long long ns) {
+  return power_uw / 1000.0 * ns / NanosecondsPerHour;
+}
+
+void CheckConstantPower() {
+  constexpr long long PowerUw = 5000000;
+  WriteFakeBattery("BAT0", EnergyNowUwh, EnergyFullUwh, PowerUw,
+                   "Discharging");
+  const int handle = BeginEnergyMeasurement();
+  Check(handle >= 0, "constant: begin failed");
+  Sleep(IntervalNs);
+  EnergyMeasurement measurement;
+  if (EndEnergyMeasurement(handle, &measurement) != 0) {
+    Check(false, "constant: end failed");
+    return;
+  }
+  const double expected_mwh =
+      EnergyMwh(PowerUw, std::llround(measurement.duration_s * 1e9));
+  Check(measurement.duration_s >= IntervalNs / 1e9, "constant: too short");
+  Check(std::fabs(measurement.energy_mwh - expected_mwh) <
+            Epsilon * expected_mwh,
+        "constant: wrong energy");
+  Check(measurement.error_mwh == 0, "constant: nonzero error bound");
+  Check(measurement.energy_now_delta_mwh == 0, "constant: energy_now moved");
+  Check(measurement.number_of_samples > 0, "constant: no samples");
+  Check(measurement.is_discharging == 1, "constant: not discharging");
+}
+
+// The power steps up halfway. The real energy is known up to the time the
+// test takes to call into the meter and to write the new value.
+void CheckPowerStep() {
+  constexpr long long LowPowerUw = 5000000;
+  constexpr long long HighPowerUw = 10000000;
+  constexpr long long DrawnUwh = 10000;
+  WriteFakeBattery("BAT0", EnergyNowUwh, EnergyFullUwh, LowPowerUw,
+                   "Discharging");
+  // Let the sampler see the low power before the interval starts.
+  Sleep(IntervalNs / 4);
+  const long long before_begin_ns = MonotonicNowNs();
+  const int handle = BeginEnergyMeasurement();
+  const long long after_begin_ns = MonotonicNowNs();
+  Check(handle >= 0, "step: begin failed");
+  Sleep(IntervalNs);
+  const long long before_step_ns = MonotonicNowNs();
+  WriteFakeBattery("BAT0", EnergyNowUwh - DrawnUwh, EnergyFullUwh,
+                   HighPowerUw, "Discharging");
+  const long long after_step_ns = MonotonicNowNs();
+  Sleep(IntervalNs);
+  EnergyMeasurement measurement;
+  if (EndEnergyMeasurement(handle, &measurement) != 0) {
+    Check(false, "step: end failed");
+    return;
+  }
+  // Real = high power over the whole interval, minus the difference before
+  // the step, which started between these bounds.
+  const long long duration_ns = std::llround(measurement.duration_s * 1e9);
+  const double all_high_mwh = EnergyMwh(HighPowerUw, duration_ns);
+  const long long power_step_uw = HighPowerUw - LowPowerUw;
+  const double min_real_mwh =
+      all_high_mwh - EnergyMwh(power_step_uw, after_step_ns - before_begin_ns);
+  const double max_real_mwh =
+      all_high_mwh - EnergyMwh(power_step_uw, before_step_ns - after_begin_ns);
+  Check(measurement.energy_mwh >= min_real_mwh - measurement.error_mwh and
+            measurement.energy_mwh <= max_real_mwh + measurement.error_mwh,
+        "step: the real energy is out of the error bound");
+  Check(measurement.error_mwh > 0, "step: zero error bound");
+  // The step falls in one sampling period, and each end adds at most one
+  // more; a second leaves plenty of room for a slow scheduler.
+  Check(measurement.error_mwh < EnergyMwh(power_step_uw, 1000000000LL),
+        "step: the error bound is too loose");
+  Check(std::fabs(measurement.energy_now_delta_mwh - DrawnUwh / 1000.0) <
+            Epsilon,
+        "step: wrong energy_now delta");
+  Check(measurement.is_discharging == 1, "step: not discharging");
+}
+
+void CheckCharging() {
+  WriteFakeBattery("BAT0", EnergyNowUwh, EnergyFullUwh, 5000000,
+                   "Discharging");
+  const int handle = BeginEnergyMeasurement();
+  Sleep(IntervalNs / 2);
+  WriteFakeBattery("BAT0", EnergyNowUwh, EnergyFullUwh, 5000000, "Charging");
+  Sleep(IntervalNs / 2);
+  EnergyMeasurement measurement;
+  Check(EndEnergyMeasurement(handle, &measurement) == 0,
+        "charging: end failed");
+  Check(measurement.is_discharging == 0, "charging: still discharging");
+}
+
+void CheckInvalidHandles() {
+  EnergyMeasurement measurement;
+  Check(EndEnergyMeasurement(-1, &measurement) == -1,
+        "invalid: accepted -1");
+  const int handle = BeginEnergyMeasurement();
+  Check(EndEnergyMeasurement(handle, &measurement) == 0,
+        "invalid: end failed");
+  Check(EndEnergyMeasurement(handle, &measurement) == -1,
+        "invalid: ended twice");
+  // A restart leaves a gap in the integral.
+  const int restarted_handle = BeginEnergyMeasurement();
+  Check(StartPowerSampling(100) == 0, "invalid: restart failed");
+  Check(EndEnergyMeasurement(restarted_handle, &measurement) == -1,
+        "invalid: ended across a restart");
+}
+
+}  // namespace
+
+int main() {
+  RemoveFakeRoot();
+  WriteFakeBattery("BAT0", EnergyNowUwh, EnergyFullUwh, 5000000,
+                   "Discharging");
+  CheckConstantPower();
+  CheckPowerStep();
+  CheckCharging();
+  CheckInvalidHandles();
+  StopPowerSampling();
+  RemoveFakeRoot();
+  if (failures > 0) {
+    fprintf(stderr, "energy_meter_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("energy_meter_test: OK\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+#include "fake_root.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(FAKE_ROOT) or !defined(POWER_SUPPLY_PATH)
+#error "Build with FAKE_PATHS from the Makefile."
+#endif
+
+namespace {
+
+void Fail(const std::string& what, const std::string& path) {
+  fprintf(stderr, "%s %s: %s\n", what.c_str(), path.c_str(), strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+void MakeParentDirectories(const std::string& path) {
+  for (size_t slash = path.find('/'); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    const std::string directory = path.substr(0, slash);
+    if (mkdir(directory.c_str(), 0755) != 0 and errno != EEXIST) {
+      Fail("Couldn't create", directory);
+    }
+  }
+}
+
+// Writes before truncating: a reader in between still sees the new value up
+// to its newline, followed by the rest of the old one.
+void WriteFile(const std::string& path, const std::string& contents) {
+  MakeParentDirectories(path);
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    Fail("Couldn't open", path);
+  }
+  if (pwrite(fd, contents.data(), contents.size(), 0) !=
+          static_cast<ssize_t>(contents.size()) or
+      ftruncate(fd, contents.size()) != 0) {
+    Fail("Couldn't write", path);
+  }
+  close(fd);
+}
+
+int RemoveEntry(const char* path, const struct stat* stat, int type,
+                FTW* ftw) {
+  return remove(path);
+}
+
+void RemoveTree(const std::string& path) {
+  if (nftw(path.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS) != 0 and
+      errno != ENOENT) {
+    Fail("Couldn't remove", path);
+  }
+}
+
+std::string FormatInteger(long long value) {
+  return std::to_string(value) + "\n";
+}
+
+}  // namespace
+
+void RemoveFakeRoot() {
+  RemoveTree(FAKE_ROOT);
+}
+
+void WriteFakeFile(const std::string& path, const std::string& contents) {
+  WriteFile(FAKE_ROOT "/" + path, contents);
+}
+
+void RemoveFakePath(const std::string& path) {
+  RemoveTree(FAKE_ROOT "/" + path);
+}
+
+void WriteFakeBattery(const std::string& id, long long energy_now_uwh,
+                      long long energy_full_uwh, long long power_now_uw,
+                      const char* status) {
+  const std::string directory = POWER_SUPPLY_PATH "/" + id + "/";
+  WriteFile(directory + "type", "Battery\n");
+  WriteFile(directory + "energy_now", FormatInteger(energy_now_uwh));
+  WriteFile(directory + "energy_full", FormatInteger(energy_full_uwh));
+  WriteFile(directory + "power_now", FormatInteger(power_now_uw));
+  WriteFile(directory + "status", std::string(status) + "\n");
+}
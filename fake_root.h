@@ -0,0 +1,27 @@
+#ifndef FAKE_ROOT_H_
+#define FAKE_ROOT_H_
+
+#include <string>
+
+// Builds the fake sysfs and /proc trees under FAKE_ROOT that the tests point
+// POWER_SUPPLY_PATH and PROC_PATH at (see the Makefile). Any failure ends
+// the test.
+
+// Removes FAKE_ROOT with everything in it.
+void RemoveFakeRoot();
+
+// Writes @contents to @path, relative to FAKE_ROOT (eg. "proc/stat"), and
+// creates the directories on the way. An existing file is overwritten in
+// place, so that descriptors the library keeps open see the new contents.
+void WriteFakeFile(const std::string& path, const std::string& contents);
+
+// Removes @path, relative to FAKE_ROOT, with everything in it.
+void RemoveFakePath(const std::string& path);
+
+// Writes the attributes of the battery @id in the fake sysfs, in the micro
+// units of sysfs.
+void WriteFakeBattery(const std::string& id, long long energy_now_uwh,
+                      long long energy_full_uwh, long long power_now_uw,
+                      const char* status);
+
+#endif  // FAKE_ROOT_H_
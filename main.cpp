@@ -1,47 +1,559 @@
-#include <cassert>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <new>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include "battery_info.h"
+#include "energy_meter.h"
+#include "process_energy.h"
+#include "trace.h"
 
-void Callback(const BatteryInfo* bi, void* data) {
-  int* x = (int*) data;
-  printf("x = %d\n", *x);
-  printf("Callback {\n");
-  printf("  error = ");
+namespace {
+
+enum class Mode { kOnce, kStream, kBench, kTop, kMeasure };
+enum class Format { kText, kJson, kCsv };
+
+struct Options {
+  Mode mode = Mode::kOnce;
+  Format format = Format::kText;
+  int bench_iterations = 0;
+  int top_processes = 0;
+  int measure_seconds = 0;
+  BatteryInfoBackend backend = kSysfsBackend;
+  bool is_upower_stdin = false;
+  // NULL if not tracing.
+  const char* trace_path = NULL;
+};
+
+// Counted only while benchmarking, so the hook costs nothing otherwise.
+std::atomic<bool> is_counting_allocations(false);
+std::atomic<long long> allocations(0);
+
+// For --top.
+constexpr int AttributionPeriodMs = 1000;
+constexpr int AttributionWindowS = 60;
+constexpr int TopRefreshS = 2;
+
+void PrintUsage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --once               print the current state and exit (default)\n"
+          "  --stream             print a record whenever the state changes\n"
+          "  --bench N            read the state N times and print latency\n"
+          "                       percentiles\n"
+          "  --top N              every %d s, print the N processes that drew\n"
+          "                       the most battery energy in the last %d s\n"
+          "  --measure SECONDS    measure the energy drawn over SECONDS and\n"
+          "                       the CPU time the sampler took\n"
+          "  --format FORMAT      text (default), json or csv\n"
+          "  --backend BACKEND    sysfs (default) or upower, for --stream\n"
+          "  --upower-stdin       with --stream, replay recorded\n"
+          "                       `upower --monitor-detail` output from stdin\n"
+          "  --trace FILE         write trace spans to FILE as Chrome trace\n"
+          "                       JSON on exit\n",
+          program, TopRefreshS, AttributionWindowS);
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+  enum { kOnce = 256, kStream, kBench, kTop, kMeasure, kFormat, kBackend,
+         kUpowerStdin, kTrace };
+  const option long_options[] = {
+      {"once", no_argument, NULL, kOnce},
+      {"stream", no_argument, NULL, kStream},
+      {"bench", required_argument, NULL, kBench},
+      {"top", required_argument, NULL, kTop},
+      {"measure", required_argument, NULL, kMeasure},
+      {"format", required_argument, NULL, kFormat},
+      {"backend", required_argument, NULL, kBackend},
+      {"upower-stdin", no_argument, NULL, kUpowerStdin},
+      {"trace", required_argument, NULL, kTrace},
+      {NULL, 0, NULL, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (c) {
+      case kOnce:   options.mode = Mode::kOnce; break;
+      case kStream: options.mode = Mode::kStream; break;
+      case kBench: {
+        options.mode = Mode::kBench;
+        options.bench_iterations = std::atoi(optarg);
+        if (options.bench_iterations <= 0) {
+          return false;
+        }
+        break;
+      }
+      case kTop: {
+        options.mode = Mode::kTop;
+        options.top_processes = std::atoi(optarg);
+        if (options.top_processes <= 0) {
+          return false;
+        }
+        break;
+      }
+      case kMeasure: {
+        options.mode = Mode::kMeasure;
+        options.measure_seconds = std::atoi(optarg);
+        if (options.measure_seconds <= 0) {
+          return false;
+        }
+        break;
+      }
+      case kFormat: {
+        if (strcmp(optarg, "text") == 0) {
+          options.format = Format::kText;
+        } else if (strcmp(optarg, "json") == 0) {
+          options.format = Format::kJson;
+        } else if (strcmp(optarg, "csv") == 0) {
+          options.format = Format::kCsv;
+        } else {
+          return false;
+        }
+        break;
+      }
+      case kBackend: {
+        if (strcmp(optarg, "sysfs") == 0) {
+          options.backend = kSysfsBackend;
+        } else if (strcmp(optarg, "upower") == 0) {
+          options.backend = kUpowerBackend;
+        } else {
+          return false;
+        }
+        break;
+      }
+      case kUpowerStdin: {
+        options.backend = kUpowerBackend;
+        options.is_upower_stdin = true;
+        break;
+      }
+      case kTrace:  options.trace_path = optarg; break;
+      default: return false;
+    }
+  }
+  return optind == argc;
+}
+
+const char* StatusName(BatteryStatus status) {
+  switch (status) {
+    case kUnused:       return "unused";
+    case kDischarging:  return "discharging";
+    case kCharging:     return "charging";
+    case kFull:         return "full";
+    default:            return "error";
+  }
+}
+
+double UnixTime() {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void PrintJsonString(const char* text) {
+  putchar('"');
+  for (const char* c = text; *c != '\0'; c++) {
+    if (*c == '"' or *c == '\\') {
+      printf("\\%c", *c);
+    } else if (static_cast<unsigned char>(*c) < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+void PrintText(const BatteryInfo* bi) {
+  if (bi->error != NULL) {
+    printf("error: %s\n", bi->error);
+  }
+  for (int i = 0; i < bi->number_of_batteries; i++) {
+    printf("battery %d: %.2lf%% %s\n",
+           i + 1, bi->sbis[i].charge, StatusName(bi->sbis[i].status));
+  }
+  if (bi->minutes_left < 0) {
+    printf("time left: unknown\n");
+  } else {
+    printf("time left: %02d:%02d\n",
+           bi->minutes_left / 60, bi->minutes_left % 60);
+  }
+}
+
+void PrintJson(const BatteryInfo* bi) {
+  printf("{\"time\":%.3lf,\"error\":", UnixTime());
   if (bi->error == NULL) {
-    printf("NULL\n");
+    printf("null");
   } else {
-    printf("%s\n", bi->error);
+    PrintJsonString(bi->error);
   }
-  printf("  number_of_batteries = %d\n", bi->number_of_batteries);
+  printf(",\"minutes_left\":%d,\"batteries\":[", bi->minutes_left);
   for (int i = 0; i < bi->number_of_batteries; i++) {
-    const SingleBatteryInfo& sbi = bi->sbis[i];
-    printf("  Battery {\n");
-    printf("    charge = %.2lf\n", sbi.charge);
-    printf("    status = ");
-    switch (sbi.status) {
-      case kUnused:       printf("Unused\n"); break;
-      case kDischarging:  printf("Discharging\n"); break;
-      case kCharging:     printf("Charging\n"); break;
-      case kFull:         printf("Full\n"); break;
-      default:            printf("Error\n");
-    }
-    printf("  }\n");
-  }
-  printf("  minutes_left = %d (%02d:%02d)\n",
-         bi->minutes_left, bi->minutes_left / 60, bi->minutes_left % 60);
-  printf("}\n");
-}
-
-int main() {
-  int x = 123;
-  RegisterCallback(Callback, (void*) &x);
-  int y = 124;
-  RegisterCallback(Callback, (void*) &y);
-  while (true) {
-    std::this_thread::sleep_for(std::chrono::seconds(10));
+    printf("%s{\"charge\":%.2lf,\"status\":\"%s\"}", i > 0 ? "," : "",
+           bi->sbis[i].charge, StatusName(bi->sbis[i].status));
+  }
+  printf("]}\n");
+}
+
+// Quoted, with quotes doubled.
+void PrintCsvString(const char* text) {
+  putchar('"');
+  for (const char* c = text; *c != '\0'; c++) {
+    if (*c == '"') {
+      putchar('"');
+    }
+    putchar(*c == '\n' ? ' ' : *c);
+  }
+  putchar('"');
+}
+
+// One row per record, with a charge and status column pair per battery. The
+// header is repeated whenever the number of batteries changes, so that the
+// rows below it always match it.
+void PrintCsv(const BatteryInfo* bi, bool is_header_needed) {
+  if (is_header_needed) {
+    printf("time,error,minutes_left");
+    for (int i = 0; i < bi->number_of_batteries; i++) {
+      printf(",charge_%d,status_%d", i + 1, i + 1);
+    }
+    printf("\n");
+  }
+  printf("%.3lf,", UnixTime());
+  if (bi->error != NULL) {
+    PrintCsvString(bi->error);
+  }
+  printf(",%d", bi->minutes_left);
+  for (int i = 0; i < bi->number_of_batteries; i++) {
+    printf(",%.2lf,%s", bi->sbis[i].charge, StatusName(bi->sbis[i].status));
+  }
+  printf("\n");
+}
+
+struct PrintState {
+  Format format;
+  // The number of batteries in the last CSV header, -1 before the first.
+  int csv_header_batteries = -1;
+  // The last printed record, to skip updates that change nothing.
+  bool has_last = false;
+  bool had_error;
+  int minutes_left;
+  std::vector<SingleBatteryInfo> sbis;
+};
+
+bool IsSameAsLast(const PrintState& state, const BatteryInfo* bi) {
+  if (!state.has_last or state.had_error != (bi->error != NULL) or
+      state.minutes_left != bi->minutes_left or
+      static_cast<int>(state.sbis.size()) != bi->number_of_batteries) {
+    return false;
+  }
+  for (int i = 0; i < bi->number_of_batteries; i++) {
+    if (state.sbis[i].charge != bi->sbis[i].charge or
+        state.sbis[i].status != bi->sbis[i].status) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void PrintCallback(const BatteryInfo* bi, void* data) {
+  PrintState& state = *static_cast<PrintState*>(data);
+  if (IsSameAsLast(state, bi)) {
+    return;
+  }
+  state.has_last = true;
+  state.had_error = bi->error != NULL;
+  state.minutes_left = bi->minutes_left;
+  state.sbis.assign(bi->sbis, bi->sbis + bi->number_of_batteries);
+  switch (state.format) {
+    case Format::kText: PrintText(bi); break;
+    case Format::kJson: PrintJson(bi); break;
+    case Format::kCsv: {
+      PrintCsv(bi, state.csv_header_batteries != bi->number_of_batteries);
+      state.csv_header_batteries = bi->number_of_batteries;
+      break;
+    }
+  }
+  // Stdout is fully buffered; a record goes out in one write.
+  fflush(stdout);
+}
+
+void IgnoreCallback(const BatteryInfo*, void*) {}
+
+int RunOnce(const Options& options) {
+  PrintState state;
+  state.format = options.format;
+  return ReadBatteryInfo(PrintCallback, &state) == 0 ? EXIT_SUCCESS
+                                                     : EXIT_FAILURE;
+}
+
+int RunStream(const Options& options) {
+  // Blocked before any thread starts, so that only sigwait() gets them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  SetBatteryInfoBackend(options.backend);
+  if (options.is_upower_stdin) {
+    SetUpowerMonitorDescriptor(0 /* stdin */);
+  }
+  PrintState state;
+  state.format = options.format;
+  RegisterCallback(PrintCallback, &state);
+  if (options.is_upower_stdin) {
+    // A replay ends with its recording, as if interrupted.
+    std::thread([] {
+      WaitForUpowerRecordingEnd();
+      kill(getpid(), SIGTERM);
+    }).detach();
+  }
+  int signal;
+  sigwait(&signals, &signal);
+  UnregisterCallback(PrintCallback, &state);
+  return EXIT_SUCCESS;
+}
+
+long long Percentile(const std::vector<long long>& sorted, double p) {
+  const size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+int RunBench(const Options& options) {
+  std::vector<long long> latencies_ns(options.bench_iterations);
+  // The first read scans sysfs and fills the buffers; it's reported apart.
+  auto start = std::chrono::steady_clock::now();
+  is_counting_allocations = true;
+  ReadBatteryInfo(IgnoreCallback, NULL);
+  const long long first_allocations = allocations.exchange(0);
+  const long long first_ns = std::chrono::duration_cast<
+      std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+          .count();
+  for (long long& latency_ns : latencies_ns) {
+    start = std::chrono::steady_clock::now();
+    ReadBatteryInfo(IgnoreCallback, NULL);
+    latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+  is_counting_allocations = false;
+  std::sort(latencies_ns.begin(), latencies_ns.end());
+  printf("first read: %.1lf us, %lld allocations\n",
+         first_ns / 1e3, first_allocations);
+  printf("%d reads: min %.1lf us, p50 %.1lf us, p90 %.1lf us, "
+         "p99 %.1lf us, max %.1lf us\n",
+         options.bench_iterations,
+         latencies_ns.front() / 1e3,
+         Percentile(latencies_ns, 0.5) / 1e3,
+         Percentile(latencies_ns, 0.9) / 1e3,
+         Percentile(latencies_ns, 0.99) / 1e3,
+         latencies_ns.back() / 1e3);
+  printf("allocations per read: %.2lf\n",
+         static_cast<double>(allocations) / options.bench_iterations);
+  return EXIT_SUCCESS;
+}
+
+void PrintTopText(const EnergyAttributionTotals& totals,
+                  const ProcessEnergy* top, int count) {
+  printf("%.2lf mWh drawn in the last %.0lf s, %.2lf mWh by processes%s\n",
+         totals.energy_mwh, totals.window_s, totals.attributed_energy_mwh,
+         totals.is_discharging ? "" : " (not discharging)");
+  printf("%7s %-15s %10s %11s %6s\n",
+         "PID", "COMMAND", "POWER mW", "ENERGY mWh", "CPU%");
+  for (int i = 0; i < count; i++) {
+    printf("%7d %-15s %10.1lf %11.3lf %6.2lf%s\n",
+           top[i].pid, top[i].comm, top[i].average_power_mw,
+           top[i].energy_mwh, top[i].cpu_share * 100,
+           top[i].has_exited ? " (exited)" : "");
+  }
+  printf("\n");
+}
+
+void PrintTopJson(const EnergyAttributionTotals& totals,
+                  const ProcessEnergy* top, int count) {
+  printf("{\"time\":%.3lf,\"window_s\":%.3lf,\"energy_mwh\":%.4lf,"
+         "\"attributed_energy_mwh\":%.4lf,\"is_discharging\":%s,"
+         "\"processes\":[",
+         UnixTime(), totals.window_s, totals.energy_mwh,
+         totals.attributed_energy_mwh,
+         totals.is_discharging ? "true" : "false");
+  for (int i = 0; i < count; i++) {
+    printf("%s{\"pid\":%d,\"comm\":", i > 0 ? "," : "", top[i].pid);
+    PrintJsonString(top[i].comm);
+    printf(",\"energy_mwh\":%.4lf,\"average_power_mw\":%.2lf,"
+           "\"cpu_share\":%.4lf,\"has_exited\":%s}",
+           top[i].energy_mwh, top[i].average_power_mw, top[i].cpu_share,
+           top[i].has_exited ? "true" : "false");
+  }
+  printf("]}\n");
+}
+
+// One row per process, the rows of a refresh share the time.
+void PrintTopCsv(const ProcessEnergy* top, int count,
+                 bool is_header_needed) {
+  if (is_header_needed) {
+    printf("time,pid,comm,energy_mwh,average_power_mw,cpu_share,has_exited\n");
+  }
+  const double time = UnixTime();
+  for (int i = 0; i < count; i++) {
+    printf("%.3lf,%d,", time, top[i].pid);
+    PrintCsvString(top[i].comm);
+    printf(",%.4lf,%.2lf,%.4lf,%d\n", top[i].energy_mwh,
+           top[i].average_power_mw, top[i].cpu_share, top[i].has_exited);
+  }
+}
+
+int RunTop(const Options& options) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  if (StartEnergyAttribution(AttributionPeriodMs, AttributionWindowS) != 0) {
+    fprintf(stderr, "Couldn't read the battery power or /proc\n");
+    return EXIT_FAILURE;
+  }
+  std::vector<ProcessEnergy> top(options.top_processes);
+  bool is_csv_header_printed = false;
+  const timespec refresh = {TopRefreshS, 0};
+  while (sigtimedwait(&signals, NULL, &refresh) == -1) {
+    EnergyAttributionTotals totals;
+    if (GetEnergyAttributionTotals(&totals) != 0) {
+      break;
+    }
+    const int count = GetTopEnergyConsumers(top.data(), top.size());
+    switch (options.format) {
+      case Format::kText: PrintTopText(totals, top.data(), count); break;
+      case Format::kJson: PrintTopJson(totals, top.data(), count); break;
+      case Format::kCsv: {
+        PrintTopCsv(top.data(), count, !is_csv_header_printed);
+        is_csv_header_printed = true;
+        break;
+      }
+    }
+    fflush(stdout);
   }
+  StopEnergyAttribution();
   return EXIT_SUCCESS;
 }
+
+long long ProcessCpuTimeNs() {
+  timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Nothing else runs in this process meanwhile, so its CPU time is the
+// sampler's.
+int RunMeasure(const Options& options) {
+  const long long cpu_begin_ns = ProcessCpuTimeNs();
+  const int handle = BeginEnergyMeasurement();
+  if (handle == -1) {
+    fprintf(stderr, "Couldn't read the battery power\n");
+    return EXIT_FAILURE;
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(options.measure_seconds));
+  EnergyMeasurement measurement;
+  const int result = EndEnergyMeasurement(handle, &measurement);
+  const long long cpu_ns = ProcessCpuTimeNs() - cpu_begin_ns;
+  StopPowerSampling();
+  if (result != 0) {
+    fprintf(stderr, "The measurement failed\n");
+    return EXIT_FAILURE;
+  }
+  const double cpu_share = cpu_ns / (measurement.duration_s * 1e9);
+  const double us_per_sample =
+      measurement.number_of_samples > 0
+          ? cpu_ns / 1e3 / measurement.number_of_samples
+          : 0;
+  switch (options.format) {
+    case Format::kText: {
+      printf("energy: %.3lf +- %.3lf mWh over %.3lf s, %d samples%s\n",
+             measurement.energy_mwh, measurement.error_mwh,
+             measurement.duration_s, measurement.number_of_samples,
+             measurement.is_discharging ? "" : " (not discharging)");
+      printf("energy_now dropped by: %.3lf mWh\n",
+             measurement.energy_now_delta_mwh);
+      printf("sampler CPU: %.3lf ms, %.4lf%% of one CPU, %.1lf us per sample\n",
+             cpu_ns / 1e6, cpu_share * 100, us_per_sample);
+      break;
+    }
+    case Format::kJson: {
+      printf("{\"duration_s\":%.3lf,\"energy_mwh\":%.4lf,"
+             "\"error_mwh\":%.4lf,\"energy_now_delta_mwh\":%.4lf,"
+             "\"number_of_samples\":%d,\"is_discharging\":%s,"
+             "\"sampler_cpu_ms\":%.3lf,\"sampler_cpu_share\":%.6lf}\n",
+             measurement.duration_s, measurement.energy_mwh,
+             measurement.error_mwh, measurement.energy_now_delta_mwh,
+             measurement.number_of_samples,
+             measurement.is_discharging ? "true" : "false",
+             cpu_ns / 1e6, cpu_share);
+      break;
+    }
+    case Format::kCsv: {
+      printf("duration_s,energy_mwh,error_mwh,energy_now_delta_mwh,"
+             "number_of_samples,is_discharging,sampler_cpu_ms,"
+             "sampler_cpu_share\n");
+      printf("%.3lf,%.4lf,%.4lf,%.4lf,%d,%d,%.3lf,%.6lf\n",
+             measurement.duration_s, measurement.energy_mwh,
+             measurement.error_mwh, measurement.energy_now_delta_mwh,
+             measurement.number_of_samples, measurement.is_discharging,
+             cpu_ns / 1e6, cpu_share);
+      break;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+// Counts allocations for --bench. Everything the library allocates goes
+// through operator new.
+void* operator new(size_t size) {
+  if (is_counting_allocations.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void* result = std::malloc(size == 0 ? 1 : size);
+  if (result == NULL) {
+    throw std::bad_alloc();
+  }
+  return result;
+}
+
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+  std::free(pointer);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  static char stdout_buffer[1 << 16];
+  setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+  if (options.trace_path != NULL) {
+    SetTracingEnabled(1);
+  }
+  int result = EXIT_FAILURE;
+  switch (options.mode) {
+    case Mode::kOnce:   result = RunOnce(options); break;
+    case Mode::kStream: result = RunStream(options); break;
+    case Mode::kBench:  result = RunBench(options); break;
+    case Mode::kTop:    result = RunTop(options); break;
+    case Mode::kMeasure: result = RunMeasure(options); break;
+  }
+  if (options.trace_path != NULL and DumpTrace(options.trace_path) != 0) {
+    fprintf(stderr, "Couldn't write the trace to %s\n", options.trace_path);
+    result = EXIT_FAILURE;
+  }
+  return result;
+}
@@ -0,0 +1,115 @@
+#include "power_supply.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef POWER_SUPPLY_PATH
+#define POWER_SUPPLY_PATH "/sys/class/power_supply"
+#endif
+
+namespace {
+
+int OpenAttribute(const std::string& directory, const char* attribute) {
+  const std::string path = directory + "/" + attribute;
+  return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+bool IsBattery(const std::string& directory) {
+  const int fd = OpenAttribute(directory, "type");
+  if (fd == -1) {
+    return false;
+  }
+  constexpr int BufferSize = 32;
+  char buffer[BufferSize];
+  const bool result = ReadSysfsString(fd, buffer, BufferSize) and
+                      strcmp(buffer, "Battery") == 0;
+  close(fd);
+  return result;
+}
+
+void CloseIfOpen(int fd) {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+}  // namespace
+
+bool FindPowerSupplyBatteries(std::vector<PowerSupplyBattery>& batteries,
+                              std::string& error) {
+  ClosePowerSupplyBatteries(batteries);
+  DIR* dir = opendir(POWER_SUPPLY_PATH);
+  if (dir == NULL) {
+    error = "Couldn't open " POWER_SUPPLY_PATH ": " +
+            std::string(strerror(errno));
+    return false;
+  }
+  while (const dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    const std::string directory =
+        std::string(POWER_SUPPLY_PATH "/") + entry->d_name;
+    if (!IsBattery(directory)) {
+      continue;
+    }
+    PowerSupplyBattery battery;
+    battery.id = entry->d_name;
+    battery.energy_now_fd = OpenAttribute(directory, "energy_now");
+    battery.energy_full_fd = OpenAttribute(directory, "energy_full");
+    battery.power_now_fd = OpenAttribute(directory, "power_now");
+    battery.status_fd = OpenAttribute(directory, "status");
+    batteries.push_back(std::move(battery));
+  }
+  closedir(dir);
+  std::sort(batteries.begin(), batteries.end(),
+            [](const PowerSupplyBattery& battery_a,
+               const PowerSupplyBattery& battery_b) -> bool {
+              return battery_a.id < battery_b.id;
+            });
+  return true;
+}
+
+void ClosePowerSupplyBatteries(std::vector<PowerSupplyBattery>& batteries) {
+  for (const PowerSupplyBattery& battery : batteries) {
+    CloseIfOpen(battery.energy_now_fd);
+    CloseIfOpen(battery.energy_full_fd);
+    CloseIfOpen(battery.power_now_fd);
+    CloseIfOpen(battery.status_fd);
+  }
+  batteries.clear();
+}
+
+bool ReadSysfsInteger(int fd, long long& value) {
+  constexpr int BufferSize = 32;
+  char buffer[BufferSize];
+  if (!ReadSysfsString(fd, buffer, BufferSize)) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  value = std::strtoll(buffer, &end, 10);
+  return errno == 0 and end != buffer;
+}
+
+bool ReadSysfsString(int fd, char* buffer, int size) {
+  if (fd == -1) {
+    return false;
+  }
+  // Sysfs regenerates the value on every read from offset 0.
+  const ssize_t read_result = pread(fd, buffer, size - 1, 0);
+  if (read_result <= 0) {
+    return false;
+  }
+  buffer[read_result] = '\0';
+  char* newline = strchr(buffer, '\n');
+  if (newline != NULL) {
+    *newline = '\0';
+  }
+  return true;
+}
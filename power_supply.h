@@ -0,0 +1,32 @@
+#ifndef POWER_SUPPLY_H_
+#define POWER_SUPPLY_H_
+
+#include <string>
+#include <vector>
+
+// A battery from /sys/class/power_supply, with the attributes that are read
+// over and over kept open. A descriptor is -1 if the attribute is missing.
+struct PowerSupplyBattery {
+  // The directory name (eg. BAT0).
+  std::string id;
+  int energy_now_fd;
+  int energy_full_fd;
+  int power_now_fd;
+  int status_fd;
+};
+
+// Replaces @batteries with the batteries found in sysfs, sorted by id.
+// Returns false and sets @error if sysfs can't be read.
+bool FindPowerSupplyBatteries(std::vector<PowerSupplyBattery>& batteries,
+                              std::string& error);
+
+void ClosePowerSupplyBatteries(std::vector<PowerSupplyBattery>& batteries);
+
+// Reads the integer at the beginning of an open sysfs attribute. Sysfs
+// values are in micro units (eg. uWh, uW).
+bool ReadSysfsInteger(int fd, long long& value);
+
+// Reads the first line of an open sysfs attribute, without the newline.
+bool ReadSysfsString(int fd, char* buffer, int size);
+
+#endif  // POWER_SUPPLY_H_
@@ -0,0 +1,559 @@
+#include "process_energy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "power_supply.h"
+
+#ifndef PROC_PATH
+#define PROC_PATH "/proc"
+#endif
+
+namespace {
+
+constexpr int MinPeriodMs = 10;
+constexpr int MaxPeriodMs = 3600 * 1000;
+constexpr double NanosecondsPerHour = 3600e9;
+// Enough for the fields up to starttime, even with a long comm.
+constexpr int StatBufferSize = 1024;
+// A process that used no CPU time in this many ticks is idle. Most processes
+// are, so an idle process is read only every this many ticks, staggered by
+// pid, instead of on every tick.
+constexpr int IdleTicks = 8;
+
+// The fields of /proc/[pid]/stat that matter here.
+struct ProcessStat {
+  char comm[16];
+  // utime + stime, in clock ticks.
+  unsigned long long cpu_ticks;
+  // Tells a process apart from an earlier one with the same pid.
+  unsigned long long start_time;
+};
+
+struct Process {
+  char comm[16];
+  unsigned long long start_time;
+  unsigned long long cpu_ticks;
+  bool has_exited;
+  long long seen_tick;
+  // The last tick with new CPU time, or when the process was first seen.
+  long long busy_tick;
+  long long exit_tick;
+  // The CPU time used since the last tick, not attributed yet.
+  unsigned long long new_cpu_ticks;
+  // Per tick over the window, indexed by tick % window length.
+  std::vector<double> energy_mwh;
+  std::vector<unsigned long long> window_cpu_ticks;
+  double energy_mwh_sum;
+  unsigned long long cpu_ticks_sum;
+};
+
+// Per tick over the window, for the totals.
+struct TickTotals {
+  double duration_s = 0;
+  double energy_mwh = 0;
+  double attributed_energy_mwh = 0;
+  unsigned long long cpu_ticks = 0;
+};
+
+std::mutex control_mutex;
+// Never destroyed, so that a process can exit while attributing.
+std::thread* attribution_thread = nullptr;
+std::mutex sleep_mutex;
+std::condition_variable& sleep_cv = *new std::condition_variable;
+bool is_running = false;
+
+// Everything below is guarded by state_mutex. The attribution thread holds
+// it for a whole tick, which reads /proc/[pid]/stat only for the busy
+// processes and a share of the idle ones.
+std::mutex state_mutex;
+bool is_attributing = false;
+long long period_ns;
+int window_length;
+std::vector<PowerSupplyBattery> batteries;
+int proc_stat_fd = -1;
+DIR* proc_dir = NULL;
+std::unordered_map<int, Process> processes;
+std::vector<TickTotals> tick_totals;
+long long tick;
+long long last_time_ns;
+double last_power_mw;
+bool was_discharging;
+unsigned long long last_total_cpu_ticks;
+// Scratch space for GetTopEnergyConsumers().
+std::vector<const std::pair<const int, Process>*> ranking;
+
+long long MonotonicNowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Returns false if no battery reports its power.
+bool ReadBatteryPower(double& power_mw, bool& is_discharging) {
+  power_mw = 0;
+  is_discharging = false;
+  bool has_power = false;
+  for (const PowerSupplyBattery& battery : batteries) {
+    long long value;
+    if (ReadSysfsInteger(battery.power_now_fd, value)) {
+      power_mw += value / 1000.0;
+      has_power = true;
+    }
+    constexpr int BufferSize = 32;
+    char status[BufferSize];
+    if (ReadSysfsString(battery.status_fd, status, BufferSize) and
+        strcmp(status, "Discharging") == 0) {
+      is_discharging = true;
+    }
+  }
+  return has_power;
+}
+
+bool ReadWhole(int fd, char* buffer, int size) {
+  const ssize_t read_result = pread(fd, buffer, size - 1, 0);
+  if (read_result <= 0) {
+    return false;
+  }
+  buffer[read_result] = '\0';
+  return true;
+}
+
+// Sums the first line of /proc/stat: "cpu  user nice system idle iowait irq
+// softirq steal guest guest_nice". Guest time is already in user and nice.
+bool ReadTotalCpuTicks(unsigned long long& total) {
+  char buffer[StatBufferSize];
+  if (!ReadWhole(proc_stat_fd, buffer, StatBufferSize) or
+      strncmp(buffer, "cpu ", 4) != 0) {
+    return false;
+  }
+  constexpr int NumberOfSummedFields = 8;
+  total = 0;
+  char* field = buffer + 4;
+  for (int i = 0; i < NumberOfSummedFields; i++) {
+    char* end;
+    const unsigned long long value = std::strtoull(field, &end, 10);
+    if (end == field) {
+      break;
+    }
+    total += value;
+    field = end;
+  }
+  return true;
+}
+
+// Parses "pid (comm) state ppid ...". The comm may contain spaces and
+// parentheses, so the fields are counted from the last ')'.
+bool ParseProcessStat(const char* buffer, ProcessStat& stat) {
+  const char* comm_begin = strchr(buffer, '(');
+  const char* comm_end = strrchr(buffer, ')');
+  if (comm_begin == NULL or comm_end == NULL or comm_end < comm_begin or
+      comm_end[1] != ' ') {
+    return false;
+  }
+  comm_begin++;
+  const size_t length = std::min<size_t>(comm_end - comm_begin,
+                                         sizeof(stat.comm) - 1);
+  memcpy(stat.comm, comm_begin, length);
+  stat.comm[length] = '\0';
+  constexpr int UtimeField = 14;
+  constexpr int StimeField = 15;
+  constexpr int StartTimeField = 22;
+  stat.cpu_ticks = 0;
+  const char* field = comm_end + 2;
+  for (int number = 3; ; number++) {
+    if (number == UtimeField or number == StimeField or
+        number == StartTimeField) {
+      char* end;
+      const unsigned long long value = std::strtoull(field, &end, 10);
+      if (end == field) {
+        return false;
+      }
+      if (number == StartTimeField) {
+        stat.start_time = value;
+        return true;
+      }
+      stat.cpu_ticks += value;
+    }
+    field = strchr(field, ' ');
+    if (field == NULL) {
+      return false;
+    }
+    field++;
+  }
+}
+
+bool ParsePid(const char* name, int& pid) {
+  if (*name < '1' or *name > '9') {
+    return false;
+  }
+  pid = 0;
+  for (; *name != '\0'; name++) {
+    if (*name < '0' or *name > '9') {
+      return false;
+    }
+    pid = pid * 10 + (*name - '0');
+  }
+  return true;
+}
+
+void ResetWindow(Process& process) {
+  std::fill(process.energy_mwh.begin(), process.energy_mwh.end(), 0);
+  std::fill(process.window_cpu_ticks.begin(), process.window_cpu_ticks.end(),
+            0);
+  process.energy_mwh_sum = 0;
+  process.cpu_ticks_sum = 0;
+}
+
+void MarkExited(Process& process) {
+  process.has_exited = true;
+  process.exit_tick = tick;
+  process.new_cpu_ticks = 0;
+}
+
+// Reads /proc/[pid]/stat. Returns false if the process has exited since
+// readdir(). The file is opened and closed every time: keeping one open per
+// process would take a descriptor for every process on the system, and
+// IdleTicks leaves few reads per tick anyway.
+bool ReadProcessStat(int pid, ProcessStat& stat) {
+  char path[32];
+  snprintf(path, sizeof(path), "%d/stat", pid);
+  const int fd = openat(dirfd(proc_dir), path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  char buffer[StatBufferSize];
+  const bool is_read = ReadWhole(fd, buffer, StatBufferSize) and
+                       ParseProcessStat(buffer, stat);
+  close(fd);
+  return is_read;
+}
+
+// Reads a process seen in /proc. A pid reused since the last tick shows up
+// as a different start time.
+void UpdateProcess(int pid, bool is_first_tick) {
+  ProcessStat stat;
+  if (!ReadProcessStat(pid, stat)) {
+    return;
+  }
+  auto it = processes.find(pid);
+  if (it != processes.end() and !it->second.has_exited and
+      it->second.start_time == stat.start_time) {
+    Process& process = it->second;
+    process.new_cpu_ticks = stat.cpu_ticks >= process.cpu_ticks
+                                ? stat.cpu_ticks - process.cpu_ticks
+                                : 0;
+    process.cpu_ticks = stat.cpu_ticks;
+    process.seen_tick = tick;
+    if (process.new_cpu_ticks > 0) {
+      process.busy_tick = tick;
+    }
+    memcpy(process.comm, stat.comm, sizeof(process.comm));
+    return;
+  }
+  if (it == processes.end()) {
+    it = processes.emplace(pid, Process()).first;
+    it->second.energy_mwh.resize(window_length);
+    it->second.window_cpu_ticks.resize(window_length);
+  }
+  Process& process = it->second;
+  ResetWindow(process);
+  process.has_exited = false;
+  process.start_time = stat.start_time;
+  // Unless this is the first scan, the process started after the previous
+  // one, so all its CPU time is new.
+  process.new_cpu_ticks = is_first_tick ? 0 : stat.cpu_ticks;
+  process.cpu_ticks = stat.cpu_ticks;
+  process.seen_tick = tick;
+  process.busy_tick = tick;
+  memcpy(process.comm, stat.comm, sizeof(process.comm));
+}
+
+// Returns true if @process is idle and it isn't its turn to be read. Its CPU
+// time, if any, is then picked up on its turn, at most IdleTicks - 1 ticks
+// late. So is a new process that reuses its pid.
+bool CanSkip(int pid, const Process& process) {
+  return !process.has_exited and tick - process.busy_tick >= IdleTicks and
+         (pid + tick) % IdleTicks != 0;
+}
+
+// Lists /proc on every tick, so that new processes are picked up right away
+// and exits are seen without reading anything.
+void ScanProcesses(bool is_first_tick) {
+  rewinddir(proc_dir);
+  while (const dirent* entry = readdir(proc_dir)) {
+    int pid;
+    if (!ParsePid(entry->d_name, pid)) {
+      continue;
+    }
+    auto it = processes.find(pid);
+    if (it != processes.end() and CanSkip(pid, it->second)) {
+      it->second.seen_tick = tick;
+    } else {
+      UpdateProcess(pid, is_first_tick);
+    }
+  }
+  for (auto& pid_and_process : processes) {
+    Process& process = pid_and_process.second;
+    if (!process.has_exited and process.seen_tick != tick) {
+      MarkExited(process);
+    }
+  }
+}
+
+// Splits the energy drawn since the last tick among the processes by their
+// CPU time since then, as a share of the CPU time of the whole machine.
+void Attribute(double energy_mwh, unsigned long long total_cpu_ticks,
+               TickTotals& totals) {
+  unsigned long long process_cpu_ticks = 0;
+  for (const auto& pid_and_process : processes) {
+    process_cpu_ticks += pid_and_process.second.new_cpu_ticks;
+  }
+  // The per-process times and the total are read at slightly different
+  // moments, so the processes may add up to a bit more than the total.
+  const unsigned long long denominator =
+      std::max(total_cpu_ticks, process_cpu_ticks);
+  const int slot = tick % window_length;
+  for (auto it = processes.begin(); it != processes.end();) {
+    Process& process = it->second;
+    const double energy =
+        denominator == 0 ? 0
+                         : energy_mwh * process.new_cpu_ticks / denominator;
+    process.energy_mwh_sum += energy - process.energy_mwh[slot];
+    process.energy_mwh[slot] = energy;
+    process.cpu_ticks_sum +=
+        process.new_cpu_ticks - process.window_cpu_ticks[slot];
+    process.window_cpu_ticks[slot] = process.new_cpu_ticks;
+    process.new_cpu_ticks = 0;
+    totals.attributed_energy_mwh += energy;
+    if (process.has_exited and tick - process.exit_tick >= window_length) {
+      // Out of the window.
+      it = processes.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Tick() {
+  std::lock_guard<std::mutex> lock(state_mutex);
+  const bool is_first_tick = tick == 0;
+  const long long time_ns = MonotonicNowNs();
+  double power_mw;
+  bool is_discharging;
+  if (!ReadBatteryPower(power_mw, is_discharging)) {
+    power_mw = 0;
+    is_discharging = false;
+  }
+  unsigned long long total_cpu_ticks;
+  if (!ReadTotalCpuTicks(total_cpu_ticks)) {
+    total_cpu_ticks = last_total_cpu_ticks;
+  }
+  tick++;
+  ScanProcesses(is_first_tick);
+  TickTotals& totals = tick_totals[tick % window_length];
+  totals = TickTotals();
+  if (!is_first_tick) {
+    totals.duration_s = (time_ns - last_time_ns) / 1e9;
+    totals.cpu_ticks = total_cpu_ticks - last_total_cpu_ticks;
+    // Trapezoid rule, as in the energy meter. Power drawn while charging
+    // comes from the charger, not the batteries.
+    if (is_discharging and was_discharging) {
+      totals.energy_mwh = (power_mw + last_power_mw) / 2 *
+                          (time_ns - last_time_ns) / NanosecondsPerHour;
+    }
+  }
+  Attribute(totals.energy_mwh, totals.cpu_ticks, totals);
+  last_time_ns = time_ns;
+  last_power_mw = power_mw;
+  was_discharging = is_discharging;
+  last_total_cpu_ticks = total_cpu_ticks;
+}
+
+void AttributionLoop() {
+  long long next_ns = MonotonicNowNs();
+  std::unique_lock<std::mutex> lock(sleep_mutex);
+  while (is_running) {
+    next_ns += period_ns;
+    const auto deadline = std::chrono::steady_clock::time_point(
+        std::chrono::nanoseconds(next_ns));
+    if (sleep_cv.wait_until(lock, deadline, [] { return !is_running; })) {
+      break;
+    }
+    lock.unlock();
+    Tick();
+    const long long now_ns = MonotonicNowNs();
+    if (now_ns - next_ns > period_ns) {
+      // Fell behind (eg. after a suspend), don't try to catch up.
+      next_ns = now_ns;
+    }
+    lock.lock();
+  }
+}
+
+void StopLocked() {
+  if (attribution_thread == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    is_running = false;
+  }
+  sleep_cv.notify_all();
+  attribution_thread->join();
+  delete attribution_thread;
+  attribution_thread = nullptr;
+  std::lock_guard<std::mutex> lock(state_mutex);
+  is_attributing = false;
+  ClosePowerSupplyBatteries(batteries);
+  close(proc_stat_fd);
+  proc_stat_fd = -1;
+  closedir(proc_dir);
+  proc_dir = NULL;
+  processes.clear();
+}
+
+int StartLocked(int period_ms, int window_s) {
+  if (period_ms < MinPeriodMs or period_ms > MaxPeriodMs or window_s <= 0) {
+    return -1;
+  }
+  StopLocked();
+  std::lock_guard<std::mutex> lock(state_mutex);
+  std::string error;
+  double power_mw;
+  bool is_discharging;
+  if (!FindPowerSupplyBatteries(batteries, error) or
+      !ReadBatteryPower(power_mw, is_discharging)) {
+    ClosePowerSupplyBatteries(batteries);
+    return -1;
+  }
+  proc_stat_fd = open(PROC_PATH "/stat", O_RDONLY | O_CLOEXEC);
+  proc_dir = opendir(PROC_PATH);
+  if (proc_stat_fd == -1 or proc_dir == NULL) {
+    if (proc_stat_fd != -1) {
+      close(proc_stat_fd);
+      proc_stat_fd = -1;
+    }
+    if (proc_dir != NULL) {
+      closedir(proc_dir);
+      proc_dir = NULL;
+    }
+    ClosePowerSupplyBatteries(batteries);
+    return -1;
+  }
+  period_ns = period_ms * 1000000LL;
+  window_length = std::max(1LL, window_s * 1000LL / period_ms);
+  tick_totals.assign(window_length, TickTotals());
+  tick = 0;
+  is_attributing = true;
+  return 0;
+}
+
+bool ConsumesMore(const std::pair<const int, Process>* a,
+                  const std::pair<const int, Process>* b) {
+  if (a->second.energy_mwh_sum != b->second.energy_mwh_sum) {
+    return a->second.energy_mwh_sum > b->second.energy_mwh_sum;
+  }
+  return a->second.cpu_ticks_sum > b->second.cpu_ticks_sum;
+}
+
+TickTotals SumTickTotals() {
+  TickTotals sum;
+  for (const TickTotals& totals : tick_totals) {
+    sum.duration_s += totals.duration_s;
+    sum.energy_mwh += totals.energy_mwh;
+    sum.attributed_energy_mwh += totals.attributed_energy_mwh;
+    sum.cpu_ticks += totals.cpu_ticks;
+  }
+  return sum;
+}
+
+}  // namespace
+
+int StartEnergyAttribution(int period_ms, int window_s) {
+  std::lock_guard<std::mutex> lock(control_mutex);
+  if (StartLocked(period_ms, window_s) != 0) {
+    return -1;
+  }
+  // The first tick only takes the baselines, so that the first attribution
+  // comes one period after this returns.
+  Tick();
+  is_running = true;
+  attribution_thread = new std::thread(AttributionLoop);
+  return 0;
+}
+
+void StopEnergyAttribution(void) {
+  std::lock_guard<std::mutex> lock(control_mutex);
+  StopLocked();
+}
+
+int TickEnergyAttribution(void) {
+  std::lock_guard<std::mutex> lock(control_mutex);
+  if (attribution_thread == nullptr) {
+    return -1;
+  }
+  Tick();
+  return 0;
+}
+
+int GetTopEnergyConsumers(ProcessEnergy* top, int max_processes) {
+  std::lock_guard<std::mutex> lock(state_mutex);
+  if (!is_attributing or max_processes <= 0) {
+    return 0;
+  }
+  const TickTotals sum = SumTickTotals();
+  ranking.clear();
+  for (const auto& pid_and_process : processes) {
+    if (pid_and_process.second.cpu_ticks_sum > 0) {
+      ranking.push_back(&pid_and_process);
+    }
+  }
+  const int count =
+      std::min(max_processes, static_cast<int>(ranking.size()));
+  std::partial_sort(ranking.begin(), ranking.begin() + count, ranking.end(),
+                    ConsumesMore);
+  for (int i = 0; i < count; i++) {
+    const Process& process = ranking[i]->second;
+    ProcessEnergy& entry = top[i];
+    entry.pid = ranking[i]->first;
+    memcpy(entry.comm, process.comm, sizeof(entry.comm));
+    // Running sums of doubles may drift a hair below zero.
+    entry.energy_mwh = std::max(0.0, process.energy_mwh_sum);
+    entry.average_power_mw =
+        sum.duration_s > 0 ? entry.energy_mwh * 3600 / sum.duration_s : 0;
+    entry.cpu_share =
+        sum.cpu_ticks > 0
+            ? std::min(1.0, static_cast<double>(process.cpu_ticks_sum) /
+                                sum.cpu_ticks)
+            : 0;
+    entry.has_exited = process.has_exited;
+  }
+  return count;
+}
+
+int GetEnergyAttributionTotals(EnergyAttributionTotals* totals) {
+  std::lock_guard<std::mutex> lock(state_mutex);
+  if (!is_attributing) {
+    return -1;
+  }
+  const TickTotals sum = SumTickTotals();
+  totals->window_s = sum.duration_s;
+  totals->energy_mwh = sum.energy_mwh;
+  totals->attributed_energy_mwh = sum.attributed_energy_mwh;
+  totals->is_discharging = was_discharging;
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef PROCESS_ENERGY_H_
+#define PROCESS_ENERGY_H_
+
+#if __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  int pid;
+  // As in /proc/[pid]/stat, truncated by the kernel to 15 characters.
+  char comm[16];
+
+  // The share of the discharge energy attributed to the process over the
+  // window, and the same spread over the window.
+  double energy_mwh;
+  double average_power_mw;
+
+  // The CPU time of the process over the window, as a fraction of the CPU
+  // time of the whole machine (all CPUs, idle included): [0, 1].
+  double cpu_share;
+
+  // 1 if the process exited during the window, 0 otherwise.
+  int has_exited;
+} ProcessEnergy;
+
+typedef struct {
+  // The time covered so far, at most the window passed to
+  // StartEnergyAttribution().
+  double window_s;
+
+  // The energy drawn from the batteries over the window, and the part of it
+  // attributed to processes. The rest was drawn while the CPUs were idle.
+  double energy_mwh;
+  double attributed_energy_mwh;
+
+  // 1 if the batteries were discharging at the last sample, 0 otherwise.
+  // Nothing is attributed while charging.
+  int is_discharging;
+} EnergyAttributionTotals;
+
+// Starts (or restarts) attributing the battery discharge power to processes
+// every @period_ms milliseconds, in proportion to the CPU time they used,
+// over a sliding window of the last @window_s seconds.
+// Returns 0 on success, -1 on failure (eg. no battery power in sysfs).
+int StartEnergyAttribution(int period_ms, int window_s);
+void StopEnergyAttribution(void);
+
+// Attributes right away on the calling thread, besides the periodic ticks
+// (eg. in a test, with a period long enough that they never come).
+// Returns 0 on success, -1 if attribution isn't running.
+int TickEnergyAttribution(void);
+
+// Fills at most @max_processes entries of @processes with the processes that
+// drew the most energy over the window, most first. Returns their number.
+int GetTopEnergyConsumers(ProcessEnergy* processes, int max_processes);
+
+// Returns 0 and fills @totals on success, -1 if attribution isn't running.
+int GetEnergyAttributionTotals(EnergyAttributionTotals* totals);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // PROCESS_ENERGY_H_
@@ -0,0 +1,192 @@
+// Runs the attribution against fake /proc and sysfs trees, ticking by hand
+// with a period so long that no periodic tick comes in between, and checks
+// how the energy of each tick is split among the processes.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include "fake_root.h"
+#include "process_energy.h"
+
+namespace {
+
+constexpr int PeriodMs = 3600 * 1000;
+// In ticks of PeriodMs.
+constexpr int WindowTicks = 3;
+constexpr int LongWindowTicks = 32;
+// A tick spans a few milliseconds, so that it has some energy to split.
+constexpr long long TickSpacingNs = 5000000;
+constexpr int MaxProcesses = 8;
+constexpr double Epsilon = 1e-9;
+
+int failures = 0;
+// Of the fake /proc/stat.
+unsigned long long total_cpu_ticks = 1000;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    fprintf(stderr, "process_energy_test: %s\n", what);
+    failures++;
+  }
+}
+
+// @utime + @stime is the CPU time of the process.
+void WriteProcess(int pid, const char* comm, unsigned long long utime,
+                  unsigned long long stime, unsigned long long start_time) {
+  char stat[256];
+  snprintf(stat, sizeof(stat),
+           "%d (%s) S 1 %d %d 0 -1 4194304 100 0 0 0 %llu %llu 0 0 20 0 1 0 "
+           "%llu 10000000 200 18446744073709551615\n",
+           pid, comm, pid, pid, utime, stime, start_time);
+  WriteFakeFile("proc/" + std::to_string(pid) + "/stat", stat);
+}
+
+// Adds @ticks to the CPU time of the machine, as user time.
+void AddTotalCpuTicks(unsigned long long ticks) {
+  total_cpu_ticks += ticks;
+  WriteFakeFile("proc/stat", "cpu  " + std::to_string(total_cpu_ticks) +
+                                 " 0 0 0 0 0 0 0 0 0\ncpu0 0 0 0 0\n");
+}
+
+bool Tick() {
+  const timespec pause = {0, TickSpacingNs};
+  nanosleep(&pause, NULL);
+  return TickEnergyAttribution() == 0;
+}
+
+double TotalEnergyMwh() {
+  EnergyAttributionTotals totals;
+  return GetEnergyAttributionTotals(&totals) == 0 ? totals.energy_mwh : -1;
+}
+
+// Returns NULL if @pid isn't among @processes.
+const ProcessEnergy* FindProcess(const ProcessEnergy* processes, int count,
+                                 int pid) {
+  for (int i = 0; i < count; i++) {
+    if (processes[i].pid == pid) {
+      return processes + i;
+    }
+  }
+  return NULL;
+}
+
+bool IsClose(double value, double expected) {
+  return std::fabs(value - expected) <= Epsilon * std::fabs(expected);
+}
+
+// Pid 100 has a comm that looks like the end of the comm field, 200 exits,
+// and 300 is reused by a new process.
+void CheckSharesExitAndReuse() {
+  WriteProcess(100, "a) S 1 (b", 10, 0, 50);
+  WriteProcess(200, "worker", 5, 0, 60);
+  WriteProcess(300, "old", 0, 0, 70);
+  AddTotalCpuTicks(0);
+  if (StartEnergyAttribution(PeriodMs, WindowTicks * PeriodMs / 1000) != 0) {
+    Check(false, "start failed");
+    return;
+  }
+  // Of the 100 ticks, 30 + 10 + 5 go to processes, and 55 were idle.
+  WriteProcess(100, "a) S 1 (b", 30, 10, 50);
+  WriteProcess(200, "worker", 15, 0, 60);
+  WriteProcess(300, "old", 5, 0, 70);
+  AddTotalCpuTicks(100);
+  Check(Tick(), "tick 1 failed");
+  const double first_energy_mwh = TotalEnergyMwh();
+  Check(first_energy_mwh > 0, "tick 1: no energy");
+  EnergyAttributionTotals totals;
+  GetEnergyAttributionTotals(&totals);
+  Check(IsClose(totals.attributed_energy_mwh, 0.45 * first_energy_mwh),
+        "tick 1: the idle share was attributed");
+  Check(totals.is_discharging == 1, "tick 1: not discharging");
+  ProcessEnergy processes[MaxProcesses];
+  int count = GetTopEnergyConsumers(processes, MaxProcesses);
+  Check(count == 3, "tick 1: wrong number of processes");
+  Check(count > 0 and processes[0].pid == 100 and
+            strcmp(processes[0].comm, "a) S 1 (b") == 0,
+        "tick 1: wrong top process");
+  Check(count > 0 and
+            IsClose(processes[0].energy_mwh, 0.3 * first_energy_mwh) and
+            IsClose(processes[0].cpu_share, 0.3),
+        "tick 1: wrong share of 100");
+  Check(count > 1 and
+            IsClose(processes[1].energy_mwh, 0.1 * first_energy_mwh),
+        "tick 1: wrong share of 200");
+  Check(count > 2 and
+            IsClose(processes[2].energy_mwh, 0.05 * first_energy_mwh),
+        "tick 1: wrong share of 300");
+  // 200 exits, and a new process takes pid 300 with 7 ticks behind it, all
+  // of them new.
+  RemoveFakePath("proc/200");
+  WriteProcess(300, "new", 7, 0, 90);
+  AddTotalCpuTicks(100);
+  Check(Tick(), "tick 2 failed");
+  const double second_energy_mwh = TotalEnergyMwh() - first_energy_mwh;
+  count = GetTopEnergyConsumers(processes, MaxProcesses);
+  const ProcessEnergy* exited = FindProcess(processes, count, 200);
+  Check(exited != NULL and exited->has_exited == 1 and
+            IsClose(exited->energy_mwh, 0.1 * first_energy_mwh),
+        "tick 2: the exited process lost its energy");
+  const ProcessEnergy* reused = FindProcess(processes, count, 300);
+  Check(reused != NULL and strcmp(reused->comm, "new") == 0 and
+            reused->has_exited == 0 and
+            IsClose(reused->energy_mwh, 0.07 * second_energy_mwh),
+        "tick 2: the reused pid kept the old process");
+  // Once its energy is out of the window, the exited process goes.
+  for (int i = 0; i < WindowTicks; i++) {
+    AddTotalCpuTicks(100);
+    Check(Tick(), "tick failed");
+  }
+  count = GetTopEnergyConsumers(processes, MaxProcesses);
+  Check(FindProcess(processes, count, 200) == NULL,
+        "the exited process stayed after the window");
+  StopEnergyAttribution();
+}
+
+// An idle process isn't read on every tick, but its CPU time is picked up
+// on its turn.
+void CheckIdleProcess() {
+  constexpr int IdleTicks = 8;
+  RemoveFakePath("proc");
+  WriteProcess(100, "sleeper", 10, 0, 50);
+  AddTotalCpuTicks(0);
+  if (StartEnergyAttribution(PeriodMs, LongWindowTicks * PeriodMs / 1000) !=
+      0) {
+    Check(false, "idle: start failed");
+    return;
+  }
+  for (int i = 0; i < IdleTicks; i++) {
+    AddTotalCpuTicks(100);
+    Check(Tick(), "idle: tick failed");
+  }
+  WriteProcess(100, "sleeper", 60, 0, 50);
+  for (int i = 0; i < IdleTicks; i++) {
+    AddTotalCpuTicks(100);
+    Check(Tick(), "idle: tick failed");
+  }
+  ProcessEnergy processes[MaxProcesses];
+  const int count = GetTopEnergyConsumers(processes, MaxProcesses);
+  Check(count == 1 and IsClose(processes[0].cpu_share, 50.0 / 1600),
+        "idle: the CPU time of the idle process was lost");
+  StopEnergyAttribution();
+}
+
+}  // namespace
+
+int main() {
+  RemoveFakeRoot();
+  WriteFakeBattery("BAT0", 20000000, 24000000, 6000000, "Discharging");
+  CheckSharesExitAndReuse();
+  CheckIdleProcess();
+  Check(TickEnergyAttribution() == -1, "ticked while stopped");
+  RemoveFakeRoot();
+  if (failures > 0) {
+    fprintf(stderr, "process_energy_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("process_energy_test: OK\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// A bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Push() fails instead of overwriting when the ring is full, so the
+// consumer never sees a torn element.
+template <typename T>
+class SpscRing {
+ public:
+  // @capacity is rounded up to a power of two.
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    buffer_.resize(size);
+    mask_ = size - 1;
+  }
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Producer only.
+  bool Push(const T& element) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    buffer_[head & mask_] = element;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only.
+  bool Pop(T& element) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    element = buffer_[tail & mask_];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T> buffer_;
+  size_t mask_;
+  // Kept on separate cache lines, so that the two threads don't keep stealing
+  // the line from each other.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+#endif  // SPSC_RING_H_
@@ -0,0 +1,192 @@
+#include "trace.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <mutex>
+#include <new>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "spsc_ring.h"
+
+namespace {
+
+constexpr int ThreadBufferCapacity = 4096;
+
+struct TraceEvent {
+  // A string literal.
+  const char* name;
+  long long begin_ns;
+  long long end_ns;
+  unsigned long long correlation_id;
+  int tid;
+};
+
+// The spans of one thread. The thread pushes, DumpTrace() pops. When the
+// thread exits, the buffer goes to the next new thread, so that short-lived
+// threads don't pile up buffers.
+struct ThreadBuffer {
+  SpscRing<TraceEvent> events{ThreadBufferCapacity};
+  std::atomic<long long> dropped{0};
+};
+
+std::atomic<bool> is_enabled(getenv("BATTERY_APPLET_TRACE") != NULL);
+std::atomic<unsigned long long> next_correlation_id(1);
+
+// Buffers are never destroyed, as threads may record until the process
+// exits.
+std::mutex& buffers_mutex = *new std::mutex;
+std::vector<ThreadBuffer*>& buffers = *new std::vector<ThreadBuffer*>;
+std::vector<ThreadBuffer*>& free_buffers = *new std::vector<ThreadBuffer*>;
+// Serializes the consumers.
+std::mutex& dump_mutex = *new std::mutex;
+
+// Returns the buffer of the calling thread to the free list when it exits.
+class ThreadBufferHolder {
+ public:
+  ~ThreadBufferHolder() {
+    if (buffer_ != nullptr) {
+      std::lock_guard<std::mutex> lock(buffers_mutex);
+      free_buffers.push_back(buffer_);
+    }
+  }
+
+  ThreadBuffer& Get() {
+    if (buffer_ == nullptr) {
+      std::lock_guard<std::mutex> lock(buffers_mutex);
+      if (free_buffers.empty()) {
+        // Plain new doesn't honor the cache line alignment of the ring
+        // before C++17.
+        void* memory = aligned_alloc(alignof(ThreadBuffer),
+                                     sizeof(ThreadBuffer));
+        if (memory == NULL) {
+          throw std::bad_alloc();
+        }
+        buffers.push_back(new (memory) ThreadBuffer);
+        buffer_ = buffers.back();
+      } else {
+        buffer_ = free_buffers.back();
+        free_buffers.pop_back();
+      }
+    }
+    return *buffer_;
+  }
+
+ private:
+  ThreadBuffer* buffer_ = nullptr;
+};
+
+thread_local ThreadBufferHolder thread_buffer;
+thread_local unsigned long long correlation_id = 0;
+thread_local int tid = 0;
+
+int GetTid() {
+  if (tid == 0) {
+    tid = static_cast<int>(syscall(SYS_gettid));
+  }
+  return tid;
+}
+
+void WriteEvent(FILE* file, const TraceEvent& event, bool is_first) {
+  // Chrome wants microseconds; ts and dur keep nanosecond precision.
+  fprintf(file,
+          "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,"
+          "\"dur\":%lld.%03lld,\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"correlation_id\":%llu}}",
+          is_first ? "" : ",", event.name,
+          event.begin_ns / 1000, event.begin_ns % 1000,
+          (event.end_ns - event.begin_ns) / 1000,
+          (event.end_ns - event.begin_ns) % 1000,
+          static_cast<int>(getpid()), event.tid, event.correlation_id);
+}
+
+}  // namespace
+
+void SetTracingEnabled(int new_is_enabled) {
+  is_enabled.store(new_is_enabled != 0, std::memory_order_relaxed);
+}
+
+int IsTracingEnabled(void) {
+  return is_enabled.load(std::memory_order_relaxed);
+}
+
+long long TraceNowNs(void) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+long long TraceBeginNs(void) {
+  return IsTracingEnabled() ? TraceNowNs() : -1;
+}
+
+void TraceSpan(const char* name, long long begin_ns) {
+  if (begin_ns == -1 or !IsTracingEnabled()) {
+    return;
+  }
+  TraceEvent event;
+  event.name = name;
+  event.begin_ns = begin_ns;
+  event.end_ns = TraceNowNs();
+  event.correlation_id = correlation_id;
+  event.tid = GetTid();
+  ThreadBuffer& buffer = thread_buffer.Get();
+  if (!buffer.events.Push(event)) {
+    buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void SetTraceCorrelationId(unsigned long long new_correlation_id) {
+  correlation_id = new_correlation_id;
+}
+
+unsigned long long GetTraceCorrelationId(void) {
+  return correlation_id;
+}
+
+unsigned long long StartTraceCorrelation(void) {
+  correlation_id =
+      next_correlation_id.fetch_add(1, std::memory_order_relaxed);
+  return correlation_id;
+}
+
+int DumpTrace(const char* path) {
+  std::lock_guard<std::mutex> dump_lock(dump_mutex);
+  // Not following a symlink keeps a planted link from redirecting the
+  // trace, and a new file is only for the user to read.
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                                O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+  FILE* file = fdopen(fd, "w");
+  if (file == NULL) {
+    close(fd);
+    return -1;
+  }
+  std::vector<ThreadBuffer*> buffers_copy;
+  {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    buffers_copy = buffers;
+  }
+  fprintf(file, "{\"traceEvents\":[");
+  bool is_first = true;
+  long long dropped = 0;
+  for (ThreadBuffer* buffer : buffers_copy) {
+    TraceEvent event;
+    while (buffer->events.Pop(event)) {
+      WriteEvent(file, event, is_first);
+      is_first = false;
+    }
+    dropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+  }
+  fprintf(file,
+          "\n],\"displayTimeUnit\":\"ms\","
+          "\"otherData\":{\"dropped_spans\":%lld}}\n",
+          dropped);
+  return fclose(file) == 0 ? 0 : -1;
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#if __cplusplus
+extern "C" {
+#endif
+
+// Tracing starts enabled if the BATTERY_APPLET_TRACE environment variable is
+// set. While it's disabled, spans cost one relaxed load.
+void SetTracingEnabled(int is_enabled);
+int IsTracingEnabled(void);
+
+// CLOCK_MONOTONIC, in nanoseconds.
+long long TraceNowNs(void);
+// The beginning of a span: TraceNowNs() while tracing is enabled, and -1
+// otherwise, without reading the clock.
+long long TraceBeginNs(void);
+
+// Records a span from @begin_ns until now on the calling thread, tagged with
+// its current correlation id, unless @begin_ns is -1. @name must be a string
+// literal: only the pointer is kept. A thread holds up to 4096 unread spans: once it's full,
+// new spans are dropped (and counted) until the next DumpTrace() drains it,
+// so a dump shows the first spans since the previous one.
+void TraceSpan(const char* name, long long begin_ns);
+
+// The correlation id ties together the spans caused by one event (eg. a
+// upower event) on any thread. It's per thread: set it when picking up work
+// that carries one. 0 means none.
+void SetTraceCorrelationId(unsigned long long correlation_id);
+unsigned long long GetTraceCorrelationId(void);
+// Sets a new id on the calling thread and returns it.
+unsigned long long StartTraceCorrelation(void);
+
+// Moves the recorded spans of all threads into @path as Chrome trace_event
+// JSON (for chrome://tracing or Perfetto). A new file is created with mode
+// 0600, and a symlink at @path is refused. Returns 0 on success, -1 if the
+// file couldn't be written.
+int DumpTrace(const char* path);
+
+#if __cplusplus
+}  // extern "C"
+
+// Records a span for the enclosing scope.
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(name), begin_ns_(TraceBeginNs()) {}
+  ~TraceScope() {
+    TraceSpan(name_, begin_ns_);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char* name_;
+  long long begin_ns_;
+};
+#endif
+
+#endif  // TRACE_H_
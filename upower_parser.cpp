@@ -0,0 +1,226 @@
+#include "upower_parser.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+constexpr char BatteryPathMarker[] = "/battery_";
+
+bool IsSpace(char c) {
+  return c == ' ' or c == '\t' or c == '\r';
+}
+
+void Trim(const char*& begin, const char*& end) {
+  while (begin < end and IsSpace(*begin)) {
+    begin++;
+  }
+  while (begin < end and IsSpace(end[-1])) {
+    end--;
+  }
+}
+
+bool StartsWith(const char* begin, const char* end, const char* prefix) {
+  const size_t length = strlen(prefix);
+  return static_cast<size_t>(end - begin) >= length and
+         memcmp(begin, prefix, length) == 0;
+}
+
+const char* Find(const char* begin, const char* end, const char* needle) {
+  const size_t length = strlen(needle);
+  for (const char* it = begin; it + length <= end; ++it) {
+    if (memcmp(it, needle, length) == 0) {
+      return it;
+    }
+  }
+  return NULL;
+}
+
+bool KeyEquals(const char* begin, const char* end, const char* key) {
+  return static_cast<size_t>(end - begin) == strlen(key) and
+         memcmp(begin, key, end - begin) == 0;
+}
+
+// Parses eg. "37.7 Wh". A line always ends with '\n' or '\0' in memory, so
+// strtod stops within it.
+bool ParseNumber(const char* begin, const char* end, double& value) {
+  if (begin == end) {
+    return false;
+  }
+  char* number_end;
+  value = std::strtod(begin, &number_end);
+  return number_end != begin and number_end <= end;
+}
+
+}  // namespace
+
+UpowerMonitorParser::UpowerMonitorParser(RecordCallback callback)
+    : callback_(std::move(callback)),
+      is_in_record_(false),
+      is_battery_(false),
+      seen_fields_(0) {}
+
+void UpowerMonitorParser::Feed(const char* data, size_t size) {
+  const char* end = data + size;
+  while (data < end) {
+    const char* newline =
+        static_cast<const char*>(memchr(data, '\n', end - data));
+    if (newline == NULL) {
+      line_.append(data, end);
+      return;
+    }
+    if (line_.empty()) {
+      ProcessLine(data, newline);
+    } else {
+      line_.append(data, newline);
+      ProcessLine(line_.data(), line_.data() + line_.size());
+      line_.clear();
+    }
+    data = newline + 1;
+  }
+}
+
+void UpowerMonitorParser::Finish() {
+  if (!line_.empty()) {
+    ProcessLine(line_.data(), line_.data() + line_.size());
+    line_.clear();
+  }
+  FinishRecord();
+}
+
+void UpowerMonitorParser::ProcessLine(const char* begin, const char* end) {
+  if (begin < end and *begin == '[') {
+    // An event: "[10:20:11.521]\tdevice changed:     /org/...".
+    FinishRecord();
+    const char* path = NULL;
+    const char* marker;
+    if ((marker = Find(begin, end, "device changed:")) != NULL) {
+      path = marker + strlen("device changed:");
+    } else if ((marker = Find(begin, end, "device added:")) != NULL) {
+      path = marker + strlen("device added:");
+    } else if ((marker = Find(begin, end, "device removed:")) != NULL) {
+      const char* path_begin = marker + strlen("device removed:");
+      const char* path_end = end;
+      Trim(path_begin, path_end);
+      if (Find(path_begin, path_end, BatteryPathMarker) != NULL) {
+        UpowerBatteryRecord removed;
+        removed.path.assign(path_begin, path_end);
+        removed.is_removed = true;
+        callback_(removed);
+      }
+    }
+    if (path != NULL) {
+      StartRecord(path, end);
+    }
+    return;
+  }
+  const char* trimmed_begin = begin;
+  const char* trimmed_end = end;
+  Trim(trimmed_begin, trimmed_end);
+  if (trimmed_begin == trimmed_end) {
+    FinishRecord();
+    return;
+  }
+  if (StartsWith(begin, end, "Device:")) {
+    // `upower --dump` starts records without indentation.
+    FinishRecord();
+    StartRecord(begin + strlen("Device:"), end);
+    return;
+  }
+  if (!IsSpace(*begin)) {
+    // Any other unindented line (eg. "Daemon:") ends the record.
+    FinishRecord();
+    return;
+  }
+  if (!is_in_record_ or !is_battery_) {
+    return;
+  }
+  const char* colon = static_cast<const char*>(
+      memchr(trimmed_begin, ':', trimmed_end - trimmed_begin));
+  if (colon == NULL) {
+    return;
+  }
+  const char* key_begin = trimmed_begin;
+  const char* key_end = colon;
+  const char* value_begin = colon + 1;
+  const char* value_end = trimmed_end;
+  Trim(key_begin, key_end);
+  Trim(value_begin, value_end);
+  if (KeyEquals(key_begin, key_end, "native-path")) {
+    record_.native_path.assign(value_begin, value_end);
+    seen_fields_ |= kNativePath;
+  } else if (KeyEquals(key_begin, key_end, "model")) {
+    record_.model.assign(value_begin, value_end);
+  } else if (KeyEquals(key_begin, key_end, "state")) {
+    record_.state.assign(value_begin, value_end);
+    seen_fields_ |= kState;
+  } else if (KeyEquals(key_begin, key_end, "energy")) {
+    if (ParseNumber(value_begin, value_end, record_.energy_wh)) {
+      seen_fields_ |= kEnergy;
+    }
+  } else if (KeyEquals(key_begin, key_end, "energy-full")) {
+    if (ParseNumber(value_begin, value_end, record_.energy_full_wh)) {
+      seen_fields_ |= kEnergyFull;
+    }
+  } else if (KeyEquals(key_begin, key_end, "energy-rate")) {
+    if (ParseNumber(value_begin, value_end, record_.energy_rate_w)) {
+      seen_fields_ |= kEnergyRate;
+    }
+  }
+}
+
+void UpowerMonitorParser::StartRecord(const char* path_begin,
+                                      const char* path_end) {
+  Trim(path_begin, path_end);
+  is_in_record_ = true;
+  is_battery_ = Find(path_begin, path_end, BatteryPathMarker) != NULL;
+  seen_fields_ = 0;
+  record_.path.assign(path_begin, path_end);
+  record_.is_removed = false;
+  record_.native_path.clear();
+  record_.model.clear();
+  record_.state.clear();
+}
+
+void UpowerMonitorParser::FinishRecord() {
+  constexpr int RequiredFields =
+      kNativePath | kEnergy | kEnergyFull | kEnergyRate | kState;
+  if (is_in_record_ and is_battery_ and seen_fields_ == RequiredFields) {
+    callback_(record_);
+  }
+  is_in_record_ = false;
+}
+
+UpowerMonitorScanner::UpowerMonitorScanner() : line_size_(0) {}
+
+int UpowerMonitorScanner::Feed(const char* data, size_t size) {
+  int events = 0;
+  const char* end = data + size;
+  while (data < end) {
+    const char* newline =
+        static_cast<const char*>(memchr(data, '\n', end - data));
+    const char* line_end = newline == NULL ? end : newline;
+    const size_t length =
+        std::min<size_t>(line_end - data, LineCapacity - line_size_);
+    memcpy(line_ + line_size_, data, length);
+    line_size_ += length;
+    if (newline == NULL) {
+      return events;
+    }
+    if (IsAddedOrRemoved()) {
+      events++;
+    }
+    line_size_ = 0;
+    data = newline + 1;
+  }
+  return events;
+}
+
+bool UpowerMonitorScanner::IsAddedOrRemoved() const {
+  const char* end = line_ + line_size_;
+  return line_size_ > 0 and line_[0] == '[' and
+         (Find(line_, end, "device added:") != NULL or
+          Find(line_, end, "device removed:") != NULL);
+}
@@ -0,0 +1,83 @@
+#ifndef UPOWER_PARSER_H_
+#define UPOWER_PARSER_H_
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+struct UpowerBatteryRecord {
+  // The D-Bus object path (eg. /org/freedesktop/UPower/devices/battery_BAT0).
+  std::string path;
+  // True if upower reported the device as removed; then only @path is set.
+  bool is_removed;
+  // The sysfs name (eg. BAT0).
+  std::string native_path;
+  std::string model;
+  double energy_wh;
+  double energy_full_wh;
+  double energy_rate_w;
+  // eg. charging, discharging, fully-charged.
+  std::string state;
+};
+
+// Parses the output of `upower --monitor-detail` or `upower --dump` as it
+// arrives. The input may be split anywhere, even in the middle of a line;
+// the parser keeps the unfinished line and record until more input comes.
+class UpowerMonitorParser {
+ public:
+  using RecordCallback = std::function<void(const UpowerBatteryRecord&)>;
+
+  // @callback is run for every complete battery record. Records of other
+  // devices (eg. line power, DisplayDevice) are skipped.
+  explicit UpowerMonitorParser(RecordCallback callback);
+
+  void Feed(const char* data, size_t size);
+
+  // Finishes the last record, for input that ends without an empty line.
+  void Finish();
+
+ private:
+  enum Field {
+    kNativePath = 1 << 0,
+    kEnergy = 1 << 1,
+    kEnergyFull = 1 << 2,
+    kEnergyRate = 1 << 3,
+    kState = 1 << 4,
+  };
+
+  void ProcessLine(const char* begin, const char* end);
+  void StartRecord(const char* path_begin, const char* path_end);
+  void FinishRecord();
+
+  RecordCallback callback_;
+  std::string line_;
+  bool is_in_record_;
+  bool is_battery_;
+  int seen_fields_;
+  UpowerBatteryRecord record_;
+};
+
+// Watches the output of `upower --monitor`, which only names the devices
+// that change, for devices coming and going. Like UpowerMonitorParser, it
+// takes input split anywhere; it keeps only the start of an unfinished line,
+// in a fixed buffer, so that it never allocates.
+class UpowerMonitorScanner {
+ public:
+  UpowerMonitorScanner();
+
+  // Returns the number of "device added:" and "device removed:" lines that
+  // @data completes.
+  int Feed(const char* data, size_t size);
+
+ private:
+  // Room for "[10:22:03.870]\tdevice removed:"; the path after it doesn't
+  // matter.
+  static constexpr size_t LineCapacity = 64;
+
+  bool IsAddedOrRemoved() const;
+
+  char line_[LineCapacity];
+  size_t line_size_;
+};
+
+#endif  // UPOWER_PARSER_H_
@@ -0,0 +1,311 @@
+// Feeds a recorded `upower --monitor-detail` session to UpowerMonitorParser
+// whole and split into every chunk size up to a few lines, and checks that
+// each split yields the same records as the recording says. Splits
+// `upower --monitor` output the same way for UpowerMonitorScanner. Then
+// replays the recording through the upower backend one event at a time, and
+// checks the snapshot that each event publishes.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "battery_info.h"
+#include "upower_parser.h"
+
+namespace {
+
+constexpr char DefaultRecordingPath[] = "testdata/upower-monitor-detail.txt";
+constexpr size_t MaxChunkSize = 256;
+
+struct ExpectedRecord {
+  const char* path;
+  bool is_removed;
+  const char* native_path;
+  const char* state;
+  double energy_wh;
+  double energy_full_wh;
+  double energy_rate_w;
+};
+
+const ExpectedRecord ExpectedRecords[] = {
+    {"/org/freedesktop/UPower/devices/battery_BAT0", false, "BAT0",
+     "discharging", 14.79, 24.61, 4.416},
+    {"/org/freedesktop/UPower/devices/battery_BAT1", false, "BAT1",
+     "discharging", 20, 20, 2},
+    {"/org/freedesktop/UPower/devices/battery_BAT0", false, "BAT0",
+     "charging", 15.2, 24.61, 10.5},
+    {"/org/freedesktop/UPower/devices/battery_BAT1", true, "", "", 0, 0, 0},
+    {"/org/freedesktop/UPower/devices/battery_BAT0", false, "BAT0",
+     "fully-charged", 24.61, 24.61, 0},
+};
+constexpr size_t NumberOfExpectedRecords =
+    sizeof(ExpectedRecords) / sizeof(ExpectedRecords[0]);
+
+constexpr int MaxBatteries = 2;
+
+// The snapshot published for the event with the @event timestamp. Events
+// without one (eg. line power) publish nothing. The backend works in mWh and
+// mW, rounded; the minutes left are rounded down.
+struct ExpectedSnapshot {
+  const char* event;
+  int number_of_batteries;
+  SingleBatteryInfo sbis[MaxBatteries];
+  int minutes_left;
+};
+
+const ExpectedSnapshot ExpectedSnapshots[] = {
+    // 14790 mWh / 4416 mW.
+    {"[10:20:11.521]", 1, {{"BAT0", 14790 * 100.0 / 24610, kDischarging}}, 200},
+    // 34790 mWh / 6416 mW.
+    {"[10:20:12.000]",
+     2,
+     {{"BAT0", 14790 * 100.0 / 24610, kDischarging},
+      {"BAT1", 100, kDischarging}},
+     325},
+    // One battery discharging makes the total discharging: 35200 mWh /
+    // 12500 mW.
+    {"[10:21:40.112]",
+     2,
+     {{"BAT0", 15200 * 100.0 / 24610, kCharging},
+      {"BAT1", 100, kDischarging}},
+     168},
+    // 9410 mWh to full / 10500 mW.
+    {"[10:22:03.870]", 1, {{"BAT0", 15200 * 100.0 / 24610, kCharging}}, 53},
+    // No power, so the time left is unknown.
+    {"[10:22:05.001]", 1, {{"BAT0", 100, kFull}}, -1},
+};
+constexpr size_t NumberOfExpectedSnapshots =
+    sizeof(ExpectedSnapshots) / sizeof(ExpectedSnapshots[0]);
+constexpr long long DeliveryTimeoutNs = 5000000000LL;
+
+struct Snapshot {
+  int number_of_batteries;
+  SingleBatteryInfo sbis[MaxBatteries];
+  int minutes_left;
+};
+
+std::mutex snapshots_mutex;
+std::vector<Snapshot> snapshots;
+
+bool IsExpected(const UpowerBatteryRecord& record,
+                const ExpectedRecord& expected) {
+  if (record.path != expected.path or
+      record.is_removed != expected.is_removed) {
+    return false;
+  }
+  if (record.is_removed) {
+    return true;
+  }
+  return record.native_path == expected.native_path and
+         record.state == expected.state and
+         std::fabs(record.energy_wh - expected.energy_wh) < 1e-9 and
+         std::fabs(record.energy_full_wh - expected.energy_full_wh) < 1e-9 and
+         std::fabs(record.energy_rate_w - expected.energy_rate_w) < 1e-9;
+}
+
+// Returns the number of failures.
+int CheckChunkSize(const std::string& recording, size_t chunk_size) {
+  std::vector<UpowerBatteryRecord> records;
+  UpowerMonitorParser parser([&records](const UpowerBatteryRecord& record) {
+    records.push_back(record);
+  });
+  for (size_t i = 0; i < recording.size(); i += chunk_size) {
+    parser.Feed(recording.data() + i,
+                std::min(chunk_size, recording.size() - i));
+  }
+  parser.Finish();
+  if (records.size() != NumberOfExpectedRecords) {
+    fprintf(stderr, "chunks of %zu: %zu records instead of %zu\n",
+            chunk_size, records.size(), NumberOfExpectedRecords);
+    return 1;
+  }
+  int failures = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    if (!IsExpected(records[i], ExpectedRecords[i])) {
+      fprintf(stderr, "chunks of %zu: record %zu (%s) is wrong\n",
+              chunk_size, i, records[i].path.c_str());
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// `upower --monitor` output, which only names the devices. The event lines
+// are longer than the scanner keeps.
+constexpr char MonitorOutput[] =
+    "Monitoring activity from the power daemon. Press Ctrl+C to cancel.\n"
+    "[10:20:11.521]\tdevice changed:     "
+    "/org/freedesktop/UPower/devices/battery_BAT0\n"
+    "[10:20:12.000]\tdevice added:       "
+    "/org/freedesktop/UPower/devices/battery_BAT1\n"
+    "[10:20:12.004]\tdaemon changed:\n"
+    "[10:22:03.870]\tdevice removed:     "
+    "/org/freedesktop/UPower/devices/battery_BAT1\n"
+    "[10:22:05.001]\tdevice changed:     "
+    "/org/freedesktop/UPower/devices/battery_BAT0\n";
+constexpr int MonitorAddedOrRemoved = 2;
+
+// Returns the number of failures.
+int CheckScannerChunkSize(size_t chunk_size) {
+  UpowerMonitorScanner scanner;
+  const size_t size = strlen(MonitorOutput);
+  int events = 0;
+  for (size_t i = 0; i < size; i += chunk_size) {
+    events += scanner.Feed(MonitorOutput + i, std::min(chunk_size, size - i));
+  }
+  if (events != MonitorAddedOrRemoved) {
+    fprintf(stderr, "monitor chunks of %zu: %d events instead of %d\n",
+            chunk_size, events, MonitorAddedOrRemoved);
+    return 1;
+  }
+  return 0;
+}
+
+void RecordSnapshot(const BatteryInfo* bi, void* data) {
+  Snapshot snapshot;
+  snapshot.number_of_batteries = bi->number_of_batteries;
+  for (int i = 0; i < std::min(bi->number_of_batteries, MaxBatteries); i++) {
+    snapshot.sbis[i] = bi->sbis[i];
+  }
+  snapshot.minutes_left = bi->minutes_left;
+  std::lock_guard<std::mutex> lock(snapshots_mutex);
+  snapshots.push_back(snapshot);
+}
+
+size_t CountSnapshots() {
+  std::lock_guard<std::mutex> lock(snapshots_mutex);
+  return snapshots.size();
+}
+
+long long MonotonicNowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool WaitForSnapshots(size_t count) {
+  const long long deadline_ns = MonotonicNowNs() + DeliveryTimeoutNs;
+  while (CountSnapshots() < count) {
+    if (MonotonicNowNs() > deadline_ns) {
+      return false;
+    }
+    const timespec pause = {0, 100000};
+    nanosleep(&pause, NULL);
+  }
+  return true;
+}
+
+// Splits @recording before every event line, so that the first event keeps
+// the banner in front of it.
+std::vector<std::string> SplitEvents(const std::string& recording) {
+  std::vector<std::string> events;
+  size_t begin = 0;
+  while (begin < recording.size()) {
+    size_t end = recording.find("\n[", begin);
+    end = end == std::string::npos ? recording.size() : end + 1;
+    events.push_back(recording.substr(begin, end - begin));
+    begin = end;
+  }
+  return events;
+}
+
+bool IsExpected(const Snapshot& snapshot, const ExpectedSnapshot& expected) {
+  if (snapshot.number_of_batteries != expected.number_of_batteries or
+      snapshot.minutes_left != expected.minutes_left) {
+    return false;
+  }
+  for (int i = 0; i < expected.number_of_batteries; i++) {
+    if (strcmp(snapshot.sbis[i].id, expected.sbis[i].id) != 0 or
+        std::fabs(snapshot.sbis[i].charge - expected.sbis[i].charge) > 1e-9 or
+        snapshot.sbis[i].status != expected.sbis[i].status) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the events one by one, waiting for the snapshot of those that
+// should publish one, so that no snapshot replaces another. The last record
+// ends with the recording, which is closed to end it. Returns the number of
+// failures.
+int CheckBackend(const std::string& recording) {
+  int p[2];
+  if (pipe(p) != 0) {
+    fprintf(stderr, "backend: pipe failed\n");
+    return 1;
+  }
+  SetBatteryInfoBackend(kUpowerBackend);
+  SetUpowerMonitorDescriptor(p[0]);
+  RegisterCallback(RecordSnapshot, NULL);
+  size_t expected_count = 0;
+  for (const std::string& event : SplitEvents(recording)) {
+    if (write(p[1], event.data(), event.size()) !=
+        static_cast<ssize_t>(event.size())) {
+      fprintf(stderr, "backend: write failed\n");
+      return 1;
+    }
+    if (expected_count < NumberOfExpectedSnapshots and
+        event.find(ExpectedSnapshots[expected_count].event) !=
+            std::string::npos) {
+      expected_count++;
+      if (expected_count < NumberOfExpectedSnapshots and
+          !WaitForSnapshots(expected_count)) {
+        fprintf(stderr, "backend: no snapshot for %s\n",
+                ExpectedSnapshots[expected_count - 1].event);
+        return 1;
+      }
+    }
+  }
+  close(p[1]);
+  WaitForUpowerRecordingEnd();
+  UnregisterCallback(RecordSnapshot, NULL);
+  std::lock_guard<std::mutex> lock(snapshots_mutex);
+  if (snapshots.size() != NumberOfExpectedSnapshots) {
+    fprintf(stderr, "backend: %zu snapshots instead of %zu\n",
+            snapshots.size(), NumberOfExpectedSnapshots);
+    return 1;
+  }
+  int failures = 0;
+  for (size_t i = 0; i < snapshots.size(); i++) {
+    if (!IsExpected(snapshots[i], ExpectedSnapshots[i])) {
+      fprintf(stderr, "backend: the snapshot for %s is wrong\n",
+              ExpectedSnapshots[i].event);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : DefaultRecordingPath;
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Couldn't open %s\n", path);
+    return EXIT_FAILURE;
+  }
+  std::stringstream recording;
+  recording << file.rdbuf();
+  int failures = CheckChunkSize(recording.str(), recording.str().size());
+  for (size_t chunk_size = 1; chunk_size <= MaxChunkSize; chunk_size++) {
+    failures += CheckChunkSize(recording.str(), chunk_size);
+    failures += CheckScannerChunkSize(chunk_size);
+  }
+  failures += CheckBackend(recording.str());
+  if (failures > 0) {
+    fprintf(stderr, "upower_parser_test: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("upower_parser_test: OK\n");
+  return EXIT_SUCCESS;
+}
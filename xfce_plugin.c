@@ -4,68 +4,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "battery_info.h"
+#include "trace.h"
 
 typedef struct {
   GtkWidget* drawing_area;
-  BatteryInfo battery_info;
 } BatteryPanelState;
 
-static void InitializeBatteryInfo(BatteryInfo* bi) {
-  bi->error = NULL;
-  bi->number_of_batteries = 0;
-  bi->sbis = NULL;
-  bi->minutes_left = -1;
-}
+#define RENDER_CACHE_SIZE 4
 
-static void ClearBatteryInfo(BatteryInfo* bi) {
-  free(bi->error);
-  free(bi->sbis);
-}
+/* A finished picture for one widget geometry. */
+typedef struct {
+  int width;
+  int height;
+  int scale;
+  /* NULL if the slot is free. */
+  cairo_surface_t* surface;
+  unsigned long last_used;
+  /* The SharedPanelState.data_generation painted into @surface. */
+  unsigned long generation;
+} CachedRender;
 
-static void CopySingleBatteryInfo(const SingleBatteryInfo* src,
-                                  SingleBatteryInfo* dst) {
-  dst->charge = src->charge;
-  dst->status = src->status;
-}
+/* All instances of the plugin in one panel process (eg. one per monitor)
+ * share a single callback registration, a single copy of every update and a
+ * single render per distinct geometry, which each instance just paints. */
+typedef struct {
+  BatteryInfoCopy battery_info;
+  /* Of BatteryPanelState*. */
+  GSList* instances;
+  CachedRender renders[RENDER_CACHE_SIZE];
+  unsigned long render_clock;
+  /* Bumped by every update. Renders of an older one are repainted in place
+   * when they are next used, so that updates don't reallocate surfaces. */
+  unsigned long data_generation;
+  /* Of the event behind @battery_info, so that drawing it is traced as part
+   * of that event. */
+  unsigned long long trace_correlation_id;
+} SharedPanelState;
 
-static void CopyBatteryInfo(const BatteryInfo* src, BatteryInfo* dst) {
-  int i, len;
-  ClearBatteryInfo(dst);
-  /* Error. */
-  if (src->error == NULL) {
-    dst->error = NULL;
-  } else {
-    len = strlen(src->error);
-    dst->error = (char*) malloc(len);
-    if (dst->error == NULL) {
-      /* Error occurred. */
-      ClearBatteryInfo(dst);
-      return;
-    } else {
-      memcpy(dst->error, src->error, len);
+static SharedPanelState shared;
+
+static void ClearRenders() {
+  int i;
+  for (i = 0; i < RENDER_CACHE_SIZE; i++) {
+    if (shared.renders[i].surface != NULL) {
+      cairo_surface_destroy(shared.renders[i].surface);
+      shared.renders[i].surface = NULL;
     }
   }
-  /* Batteries. */
-  len = dst->number_of_batteries = src->number_of_batteries;
-  dst->sbis = malloc(src->number_of_batteries * sizeof(SingleBatteryInfo));
-  if (dst->sbis == NULL) {
-    ClearBatteryInfo(dst);
-    return;
-  }
-  for (i = 0; i < len; i++) {
-    CopySingleBatteryInfo(src->sbis + i, dst->sbis + i);
-  }
-  /* Minutes left. */
-  dst->minutes_left = src->minutes_left;
 }
 
 static void BatteryInfoSlot(const BatteryInfo* src, void* data) {
-  BatteryPanelState* bps = (BatteryPanelState*) data;
+  GSList* it;
+  long long begin_ns = TraceBeginNs();
   gdk_threads_enter();
-  CopyBatteryInfo(src, &bps->battery_info);
-  gtk_widget_queue_draw(bps->drawing_area);
+  TraceSpan("GDK lock wait", begin_ns);
+  shared.trace_correlation_id = GetTraceCorrelationId();
+  CopyBatteryInfo(src, &shared.battery_info);
+  shared.data_generation++;
+  for (it = shared.instances; it != NULL; it = it->next) {
+    gtk_widget_queue_draw(((BatteryPanelState*) it->data)->drawing_area);
+  }
   gdk_threads_leave();
 }
 
@@ -238,17 +239,12 @@ static void PaintBattery(cairo_t* context, SingleBatteryInfo* sbi,
 #define MARGIN_RIGHT 10
 #define SPACING 10
 
-static gboolean DrawSlot(
-    GtkWidget* widget, cairo_t* context, gpointer data) {
+static void PaintBatteryInfo(cairo_t* context, BatteryInfo* bi,
+                             double width, double height) {
   int i;
-  double x1, y1, x2, y2;
-  double width, height;
-  BatteryPanelState* bps = (BatteryPanelState*) data;
-  BatteryInfo* bi = &bps->battery_info;
-  cairo_clip_extents(context, &x1, &y1, &x2, &y2);
-  cairo_translate(context, x1 + MARGIN_LEFT, y1 + MARGIN_UP);
-  width = x2 - x1 - MARGIN_LEFT - MARGIN_RIGHT;
-  height = y2 - y1 - MARGIN_UP - MARGIN_DOWN;
+  cairo_translate(context, MARGIN_LEFT, MARGIN_UP);
+  width -= MARGIN_LEFT + MARGIN_RIGHT;
+  height -= MARGIN_UP + MARGIN_DOWN;
   cairo_save(context);
     width -= PaintTime(context, bi, width, height);
     for (i = 0; i < bi->number_of_batteries; i++) {
@@ -259,23 +255,196 @@ static gboolean DrawSlot(
       cairo_restore(context);
     }
   cairo_restore(context);
+}
+
+static void PaintRender(CachedRender* render) {
+  cairo_t* context = cairo_create(render->surface);
+  cairo_set_operator(context, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(context);
+  cairo_set_operator(context, CAIRO_OPERATOR_OVER);
+  PaintBatteryInfo(context, &shared.battery_info.bi,
+                   render->width, render->height);
+  cairo_destroy(context);
+  render->generation = shared.data_generation;
+}
+
+/* Returns the render for the geometry, painting it if it isn't cached or
+ * shows an older update. Returns NULL if it can't be created. */
+static cairo_surface_t* GetRender(int width, int height, int scale) {
+  int i, slot = 0;
+  CachedRender* render;
+  shared.render_clock++;
+  for (i = 0; i < RENDER_CACHE_SIZE; i++) {
+    render = shared.renders + i;
+    if (render->surface != NULL && render->width == width &&
+        render->height == height && render->scale == scale) {
+      render->last_used = shared.render_clock;
+      if (render->generation != shared.data_generation) {
+        PaintRender(render);
+      }
+      return render->surface;
+    }
+    /* Evicts a free slot, or else the least recently used one. */
+    if (shared.renders[slot].surface != NULL &&
+        (render->surface == NULL ||
+         render->last_used < shared.renders[slot].last_used)) {
+      slot = i;
+    }
+  }
+  render = shared.renders + slot;
+  if (render->surface != NULL) {
+    cairo_surface_destroy(render->surface);
+  }
+  render->width = width;
+  render->height = height;
+  render->scale = scale;
+  render->last_used = shared.render_clock;
+  render->surface = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, width * scale, height * scale);
+  if (cairo_surface_status(render->surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(render->surface);
+    render->surface = NULL;
+    return NULL;
+  }
+  cairo_surface_set_device_scale(render->surface, scale, scale);
+  PaintRender(render);
+  return render->surface;
+}
+
+static gboolean DrawSlot(
+    GtkWidget* widget, cairo_t* context, gpointer data) {
+  long long begin_ns = TraceBeginNs();
+  int width = gtk_widget_get_allocated_width(widget);
+  int height = gtk_widget_get_allocated_height(widget);
+  cairo_surface_t* surface =
+      GetRender(width, height, gtk_widget_get_scale_factor(widget));
+  if (surface == NULL) {
+    PaintBatteryInfo(context, &shared.battery_info.bi, width, height);
+  } else {
+    cairo_set_source_surface(context, surface, 0, 0);
+    cairo_paint(context);
+  }
+  /* The GTK thread runs other work too, which isn't part of the event. */
+  SetTraceCorrelationId(shared.trace_correlation_id);
+  TraceSpan("DrawSlot", begin_ns);
+  SetTraceCorrelationId(0);
+  return TRUE;
+}
+
+/* Writes the spans recorded since the previous save to a new file in
+ * $XDG_RUNTIME_DIR, which only the user can read, so that no save overwrites
+ * an earlier one. */
+static void SaveTraceSlot(GtkMenuItem* item, gpointer data) {
+  static int number_of_saves = 0;
+  gchar* path;
+  const char* directory = getenv("XDG_RUNTIME_DIR");
+  if (directory == NULL || directory[0] == '\0') {
+    fprintf(stderr, "Couldn't save the trace: XDG_RUNTIME_DIR isn't set\n");
+    return;
+  }
+  number_of_saves++;
+  path = g_strdup_printf("%s/battery-applet-trace-%d-%d.json", directory,
+                         (int) getpid(), number_of_saves);
+  if (DumpTrace(path) != 0) {
+    fprintf(stderr, "Couldn't write the trace to %s\n", path);
+  } else {
+    fprintf(stderr, "Wrote the trace to %s\n", path);
+  }
+  g_free(path);
+}
+
+/* Writes @value, or "?" if it is unknown (negative). */
+static const char* FormatKnown(char* buffer, int value) {
+  if (value < 0) {
+    sprintf(buffer, "?");
+  } else {
+    sprintf(buffer, "%d", value);
+  }
+  return buffer;
+}
+
+/* Looks the details up by id, as the snapshot being shown may be older than
+ * the latest one. */
+static int AppendBatteryDetails(char* text, int size, int index,
+                                const SingleBatteryInfo* sbi) {
+  BatteryDetails details;
+  char cycles[12], full[12], design[12], start[12], stop[12];
+  if (GetBatteryDetails(sbi->id, &details) != 0) {
+    return snprintf(text, size, "Battery %d: reading details...", index + 1);
+  }
+  return snprintf(
+      text, size,
+      "Battery %d: %s %s\n"
+      "  Capacity: %s / %s mWh (design)\n"
+      "  Cycles: %s\n"
+      "  Thresholds: %s%% - %s%%%s",
+      index + 1, details.manufacturer, details.model_name,
+      FormatKnown(full, details.energy_full),
+      FormatKnown(design, details.energy_full_design),
+      FormatKnown(cycles, details.cycle_count),
+      FormatKnown(start, details.start_threshold),
+      FormatKnown(stop, details.stop_threshold),
+      details.force_discharge == 1 ? "\n  Forced to discharge" : "");
+}
+
+/* The details are fetched only when somebody looks at them. Until they
+ * arrive, the tooltip says so; GTK asks again as the pointer moves. */
+static gboolean QueryTooltipSlot(GtkWidget* widget, gint x, gint y,
+                                 gboolean keyboard_mode, GtkTooltip* tooltip,
+                                 gpointer data) {
+  int i, len = 0;
+  char text[1024];
+  BatteryInfo* bi = &shared.battery_info.bi;
+  if (bi->number_of_batteries == 0) {
+    return FALSE;
+  }
+  for (i = 0; i < bi->number_of_batteries && len < (int) sizeof(text); i++) {
+    if (i > 0) {
+      len += snprintf(text + len, sizeof(text) - len, "\n");
+    }
+    if (len < (int) sizeof(text)) {
+      len += AppendBatteryDetails(text + len, sizeof(text) - len, i,
+                                  bi->sbis + i);
+    }
+  }
+  gtk_tooltip_set_text(tooltip, text);
   return TRUE;
 }
 
 static BatteryPanelState* NewBatteryPanelState() {
+  static int is_registered = 0;
   BatteryPanelState* bps =
       (BatteryPanelState*) malloc(sizeof(BatteryPanelState));
   if (bps == NULL) {
     return NULL;
   }
-  InitializeBatteryInfo(&bps->battery_info);
   bps->drawing_area = gtk_drawing_area_new();
   g_signal_connect(G_OBJECT(bps->drawing_area), "draw",
                    G_CALLBACK(DrawSlot), (void*) bps);
-  RegisterCallback(BatteryInfoSlot, (void*) bps);
+  gtk_widget_set_has_tooltip(bps->drawing_area, TRUE);
+  g_signal_connect(G_OBJECT(bps->drawing_area), "query-tooltip",
+                   G_CALLBACK(QueryTooltipSlot), (void*) bps);
+  shared.instances = g_slist_prepend(shared.instances, bps);
+  /* The registration outlives the instances: the shared state is static, and
+   * unregistering from the GTK thread could wait for a callback that waits
+   * for the GDK lock. */
+  if (!is_registered) {
+    is_registered = 1;
+    InitializeBatteryInfoCopy(&shared.battery_info);
+    RegisterCallback(BatteryInfoSlot, NULL);
+  }
   return bps;
 }
 
+static void FreeDataSlot(XfcePanelPlugin* plugin, void* data) {
+  BatteryPanelState* bps = (BatteryPanelState*) data;
+  shared.instances = g_slist_remove(shared.instances, bps);
+  if (shared.instances == NULL) {
+    ClearRenders();
+  }
+  free(bps);
+}
+
 #define PLUGIN_WIDTH 250
 
 static gboolean SizeChangedSlot(XfcePanelPlugin* plugin,
@@ -300,7 +469,18 @@ static void BatteryPluginConstructor(XfcePanelPlugin* plugin) {
   gtk_container_add(GTK_CONTAINER(plugin), bps->drawing_area);
   g_signal_connect(G_OBJECT(plugin), "size-changed",
                    G_CALLBACK(SizeChangedSlot), bps);
+  g_signal_connect(G_OBJECT(plugin), "free-data",
+                   G_CALLBACK(FreeDataSlot), bps);
   gtk_widget_show(bps->drawing_area);
+  /* No signal is free to ask for the trace, as xfce4-panel takes SIGUSR1 and
+   * the like for itself, so the trace is saved from the plugin's menu. */
+  if (IsTracingEnabled()) {
+    GtkWidget* item = gtk_menu_item_new_with_label("Save trace");
+    g_signal_connect(G_OBJECT(item), "activate",
+                     G_CALLBACK(SaveTraceSlot), NULL);
+    xfce_panel_plugin_menu_insert_item(plugin, GTK_MENU_ITEM(item));
+    gtk_widget_show(item);
+  }
   xfce_panel_plugin_set_expand(XFCE_PANEL_PLUGIN(plugin), FALSE);
 }
 